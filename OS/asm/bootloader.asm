@@ -1,6 +1,7 @@
 [org 0x7C00]
 
 kernel_offset equ 0x1000
+kernel_stage equ 0x20000		; Where the kernel past 0x5E00 is read to, see load_kernel
 
 jmp short _start
 nop
@@ -13,11 +14,11 @@ reservedSectors			dw 1
 fatCount				db 2
 rootDirectoryEntries	dw 224
 sectorCount				dw 2880
-mediaDescriptorType		db 0b11111000
+mediaDescriptorType		db 0xF0			; 3.5" 1.44MB floppy
 sectorsPerFat			dw 9
 sectorsPerTrack			dw 18
 headCount				dw 2
-hiddenSectorCount		db 0
+hiddenSectorCount		dd 0
 largeSectorCount		dd 0
 
 ; Extended Boot Record
@@ -41,9 +42,53 @@ _start:
 
 [bits 16]
 load_kernel:
-	mov bx, kernel_offset 
-	mov dh, 48			; Load 18 (the maximum) amount of sectors in the first head and cylinder
-	call disk_load		; Load the disk so we can properly start the kernel
+	; The kernel is 144 sectors (72KB) starting right after the root directory (LBA 33)
+	; It is read a track at a time, no read crosses a track or a 64KB boundary
+	; Reading all of it into place would overwrite this code and the stack at 0x7C00-0x8000,
+	; so the tracks that would reach them go to kernel_stage instead and kernel_entry.asm moves them
+	mov ax, kernel_offset / 16
+	mov es, ax
+	mov bx, 0
+	mov si, 144			; Sectors left
+	mov ch, 0			; LBA 33 is cylinder 0, head 1, sector 16
+	mov dh, 1
+	mov cl, 16
+
+.track:
+	mov al, 19			; Read up to the end of the track
+	sub al, cl
+	mov ah, 0
+	cmp ax, si
+	jbe .read
+	mov ax, si
+
+.read:
+	call disk_load
+	sub si, ax
+	jz .done
+
+	shl ax, 5			; Sectors to paragraphs
+	mov di, es
+	add ax, di
+	mov es, ax
+
+	mov cl, 1			; The next track starts at sector 1 of the other head
+	xor dh, 1
+	jnz .place
+	inc ch				; Back to head 0 on the next cylinder
+
+.place:
+	cmp ax, (0x7C00 - 18 * 512) / 16
+	jbe .track			; A whole track still fits below the boot sector
+	cmp ax, kernel_stage / 16
+	jae .track
+	mov ax, kernel_stage / 16
+	mov es, ax
+	jmp .track
+
+.done:
+	mov ax, 0
+	mov es, ax
 
 	; Code to disable the blinking cursor
 	; The blinking cursor can only be disabled in real mode using BIOS interrupt int 0x10
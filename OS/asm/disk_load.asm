@@ -1,20 +1,17 @@
+; Read al sectors starting at cylinder ch, head dh, sector cl
 disk_load:
 	pusha 
-	push dx			; number of sectors (input parameter)
+	push ax			; number of sectors (input parameter)
 
 	mov ah, 0x02 	; read function 
-	mov al, dh 		; number of sectors
 	mov dl, 0x00 	; drive number
-	mov dh, 0x01 	; head number
-	mov ch, 0x00 	; cylinder number  
-	mov cl, 0x10 	; sector number 
 
 	; read data to [es:bx] 
 	int 0x13
 	jc error 		; carry bit is set -> error
 
 	pop dx 
-	cmp al, dh 		; read correct number of sectors
+	cmp al, dl 		; read correct number of sectors
 	jne error 
 
 	popa 
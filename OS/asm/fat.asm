@@ -1,109 +1,39 @@
+; File Allocation Table
+; FAT12, every entry is 12 bits and two entries are packed into three bytes:
+; entry 2n is byte 3n plus the low nibble of byte 3n+1, entry 2n+1 is the high nibble of byte 3n+1 plus byte 3n+2
+
+; Emits two packed entries
+%macro fat12_pair 2
+	db (%1) & 0xFF, (((%1) >> 8) & 0x0F) | (((%2) & 0x0F) << 4), ((%2) >> 4) & 0xFF
+%endmacro
+
+; Entry 0 holds the media descriptor, entry 1 is an end of chain marker
+; The kernel file (see root_dir.asm) is the 144 clusters 2-145, chained in order
+; Clusters 2831-2848 are the last track, which holds the file system's intent log, and are marked bad
+%macro fat12_table 1
+	fat12_pair 0xFF0, 0xFFF
+%assign cluster 2
+%rep 71
+	fat12_pair cluster + 1, cluster + 2
+%assign cluster cluster + 2
+%endrep
+	fat12_pair 145, 0xFFF				; Cluster 145 ends the kernel
+	times (2830 * 3 / 2) - ($ - %1) db 0
+	fat12_pair 0, 0xFF7					; Clusters 2830 and 2831
+%rep 8
+	fat12_pair 0xFF7, 0xFF7
+%endrep
+	fat12_pair 0xFF7, 0					; Cluster 2848, the last one
+%endmacro
+
 ; File Allocation Table (First Copy)
 fatCopy0:
-times 2                 dw 0
-kernelStartingCluster0  dw 3
-                        dw 4
-                        dw 5
-                        dw 6
-                        dw 7
-                        dw 8
-                        dw 9
-                        dw 10
-                        dw 11
-                        dw 12
-                        dw 13
-                        dw 14
-                        dw 15
-                        dw 16
-                        dw 17
-                        dw 18
-                        dw 19
-                        dw 20
-                        dw 21
-                        dw 22
-                        dw 23
-                        dw 24
-                        dw 25
-                        dw 26
-                        dw 27
-                        dw 28
-                        dw 29
-                        dw 30
-                        dw 31
-                        dw 32
-                        dw 33
-                        dw 34
-                        dw 35
-                        dw 36
-                        dw 37
-                        dw 38
-                        dw 39
-                        dw 40
-                        dw 41
-                        dw 42
-                        dw 43
-                        dw 44
-                        dw 45
-                        dw 46
-                        dw 47
-                        dw 48
-                        dw 49
-                        dw 50
-                        dw 0xFFFF
+fat12_table fatCopy0
 times (512 * 9) - ($ - fatCopy0) db 0
 
 ; NOTE: Make sure fatCopy0 and fatCopy1 have identical contents!
 
 ; File Allocation Table (Second Copy)
 fatCopy1:
-times 2                 dw 0
-kernelStartingCluster1  dw 3
-                        dw 4
-                        dw 5
-                        dw 6
-                        dw 7
-                        dw 8
-                        dw 9
-                        dw 10
-                        dw 11
-                        dw 12
-                        dw 13
-                        dw 14
-                        dw 15
-                        dw 16
-                        dw 17
-                        dw 18
-                        dw 19
-                        dw 20
-                        dw 21
-                        dw 22
-                        dw 23
-                        dw 24
-                        dw 25
-                        dw 26
-                        dw 27
-                        dw 28
-                        dw 29
-                        dw 30
-                        dw 31
-                        dw 32
-                        dw 33
-                        dw 34
-                        dw 35
-                        dw 36
-                        dw 37
-                        dw 38
-                        dw 39
-                        dw 40
-                        dw 41
-                        dw 42
-                        dw 43
-                        dw 44
-                        dw 45
-                        dw 46
-                        dw 47
-                        dw 48
-                        dw 49
-                        dw 50
-                        dw 0xFFFF
+fat12_table fatCopy1
 times (512 * 9) - ($ - fatCopy1) db 0
\ No newline at end of file
@@ -1,4 +1,22 @@
 [bits 32]
 [extern main]
+[extern __bss_start]
+[extern _end]
+
+; The bootloader reads the kernel up to 0x5E00 into place and the rest, which would have run over
+; the boot sector, to 0x20000, move that part up to where it belongs before anything uses it
+mov esi, 0x20000
+mov edi, 0x5E00
+mov ecx, (0x13000 - 0x5E00) / 4
+cld
+rep movsd
+
+; Nothing loads the BSS, so it holds whatever was in memory, clear it before any C code runs
+mov edi, __bss_start
+mov ecx, _end
+sub ecx, edi
+xor eax, eax
+rep stosb
+
 call main   ; Enter our kernel's main function
 jmp $
\ No newline at end of file
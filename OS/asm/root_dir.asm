@@ -2,7 +2,7 @@
 rootDir:
 fileName            db "kernel  "
 extension           db "bin"   
-attributes          db 0
+attributes          db 0x04           ; System, the bootloader loads it from fixed sectors so it must not move
 reserved            dw 0
 creationTime        dw 0
 creationDate        dw 0
@@ -11,5 +11,5 @@ ignored             dw 0
 lastWriteTime       dw 0
 lastWriteDate       dw 0
 startingCluster     dw 2
-fileSize            dd 24576
+fileSize            dd 73728
 times (512 * 14) - ($ - rootDir) db 0
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef ATA_H
+#define ATA_H
+
+#include "./types.h"
+#include "./blockdev.h"
+
+// Master and slave on the primary and secondary channels
+#define ATA_MAX_DRIVES 4
+
+// Most sectors moved by one command, one 64KB DMA transfer
+#define ATA_MAX_COMMAND_SECTORS 128
+
+// How transfers are done, DMA is only used when the drive and a PCI IDE controller support it
+typedef enum
+{
+    ATA_MODE_PIO,
+    ATA_MODE_DMA
+} ata_mode_t;
+
+typedef struct
+{
+    uint32 pioCommands;     // READ/WRITE (MULTIPLE) commands
+    uint32 dmaCommands;     // Bus-master READ/WRITE DMA commands
+    uint32 sectors;         // Sectors moved by either
+} ata_stats_t;
+
+// Find the drives on both channels and register each as a block device (hd0, hd1, ...)
+// Must run before interrupts are enabled, after the DMA pool and the block device table are set up
+// Returns how many drives were found
+int ata_install();
+
+// Same calling convention as floppy_read/floppy_write, drive is 0-3 (primary master, primary slave, ...)
+int ata_read(int drive, uint32 lba, void *address, uint16 count);
+int ata_write(int drive, uint32 lba, void *address, uint16 count);
+
+// Write everything in the drive's own write cache to the platters
+int ata_flush(int drive);
+
+void ata_set_mode(ata_mode_t mode);
+void ata_get_stats(ata_stats_t *stats);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include "./types.h"
+
+// Every device is addressed in 512 byte sectors
+#define BLOCK_SIZE 512
+
+// Most devices that can be registered at once
+#define BLOCKDEV_MAX 4
+
+// Kinds of work a request can carry
+typedef enum
+{
+    BLOCK_REQUEST_READ,
+    BLOCK_REQUEST_WRITE,
+    BLOCK_REQUEST_RECALIBRATE,  // Floppy controller only
+    BLOCK_REQUEST_RESET         // Floppy controller only
+} block_request_type_t;
+
+typedef enum
+{
+    BLOCK_REQUEST_QUEUED,   // Waiting for the device
+    BLOCK_REQUEST_ACTIVE,   // On the device, its interrupt handler moves it along
+    BLOCK_REQUEST_DONE,
+    BLOCK_REQUEST_FAILED
+} block_request_state_t;
+
+// A request is owned by whoever submits it (usually on their stack) and must
+// stay alive until it has been waited for
+typedef struct block_request
+{
+    block_request_type_t type;
+    int drive;              // Unit within the backend, blockdev_submit() fills it in
+    uint32 lba;             // Next sector to transfer
+    uint8 *address;         // Memory for the next sector
+    uint16 count;           // Sectors still to transfer
+    int retries;
+    int waiter;             // pid of the process to wake when the request finishes
+    int result;             // 0 on success, -1 on failure, -2 if write protected
+    volatile block_request_state_t state;
+    struct block_request *next;     // Next pending request
+    struct block_request *merged;   // Next request riding along in the same command
+} block_request_t;
+
+// A storage device as seen by the cache and the file system
+// Backends fill one in and hand it to blockdev_register(), the operations get the backend's unit number
+// The asynchronous operations are optional, without them requests are carried out synchronously on submit
+typedef struct
+{
+    char *name;
+    int unit;
+    uint32 sectorCount;
+    int (*read)(int unit, uint32 lba, void *address, uint16 count);
+    int (*write)(int unit, uint32 lba, void *address, uint16 count);
+    int (*flush)(int unit);                 // Empty the device's own write cache (optional)
+    void (*submit)(block_request_t *request);
+    int (*wait)(block_request_t *request);
+    void (*plug)();                         // Hold requests back so a batch can be ordered
+    void (*unplug)();
+} blockdev_t;
+
+void blockdev_init();
+
+// Returns the device number, or -1 if the table is full
+int blockdev_register(blockdev_t *device);
+
+// Returns the device number of the device called name, or -1
+int blockdev_find(char *name);
+int blockdev_count();
+blockdev_t *blockdev_get(int device);
+
+// count is in sectors, like floppy_read/floppy_write
+int blockdev_read(int device, uint32 lba, void *address, uint16 count);
+int blockdev_write(int device, uint32 lba, void *address, uint16 count);
+int blockdev_flush(int device);
+
+// Asynchronous requests, the caller fills in type, lba, address and count
+void blockdev_submit(int device, block_request_t *request);
+int blockdev_wait(int device, block_request_t *request);
+void blockdev_plug(int device);
+void blockdev_unplug(int device);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "./types.h"
+
+// Sector buffers live in low memory so they never collide with the FATs (0x20000) or file data (0x30000)
+#define CACHE_BUFFER_ADDRESS 0x50000
+
+// Hard limit on the number of cached sectors (64KB of buffers)
+#define CACHE_MAX_BLOCKS 128
+
+// Memory budget used when the kernel starts, in bytes
+#define CACHE_DEFAULT_BUDGET (32 * 1024)
+
+#define CACHE_HASH_BUCKETS 64
+
+// Most read-ahead sectors that can be in flight at once
+#define CACHE_PREFETCH_SLOTS 32
+
+// In write-back mode the flusher process syncs once every this many scheduling passes
+#define CACHE_FLUSH_INTERVAL 64
+
+// Counters for sizing the cache against a workload
+typedef struct
+{
+    uint32 hits;            // Sectors served from memory
+    uint32 misses;          // Sectors that had to be read from the drive
+    uint32 evictions;       // Valid sectors dropped to make room for new ones
+    uint32 writebacks;      // Dirty sectors written to the drive in write-back mode
+    uint32 readaheads;      // Sectors read ahead by cache_prefetch()
+    uint32 readaheadHits;   // Read-ahead sectors that were later asked for
+} cache_stats_t;
+
+// Sets the memory budget (in bytes) and empties the cache, the DMA pool must be set up first
+void cache_init(uint32 budget);
+
+// Same calling convention as blockdev_read/blockdev_write, drive is a block device number and count is in sectors
+int cache_read(int drive, uint32 lba, void *address, uint16 count);
+int cache_write(int drive, uint32 lba, void *address, uint16 count);
+
+// Start reading sectors in the background, returns how many were queued
+int cache_prefetch(int drive, uint32 lba, uint16 count);
+
+// Drop every cached sector belonging to drive, dirty sectors are NOT written back
+void cache_invalidate(int drive);
+
+// In write-back mode cache_write only marks sectors dirty, they reach the drive on cache_sync() or eviction
+// Turning write-back off syncs first
+void cache_set_write_back(int enabled);
+
+// Write every dirty sector, all of them are queued together so the floppy scheduler
+// can order them and merge consecutive sectors into one transfer
+// Devices with a write cache of their own are flushed afterwards
+int cache_sync();
+
+// Background process (see createproc) that syncs periodically until write-back is turned off
+void cache_flusher();
+
+void cache_get_stats(cache_stats_t *stats);
+
+#endif
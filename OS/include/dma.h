@@ -1,6 +1,24 @@
+#ifndef DMA_H
+#define DMA_H
+
 #include "./types.h"
 
+// ISA DMA can only address the first 16MB
+#define DMA_ISA_LIMIT 0x1000000
+
+// Pool of boundary-safe buffers, exactly one 64KB page
+#define DMA_POOL_ADDRESS 0x60000
+#define DMA_POOL_BLOCK_SIZE 512
+#define DMA_POOL_BLOCKS (0x10000 / DMA_POOL_BLOCK_SIZE)
+
 void maskChannel(uint8 channel, int masked);
 void initFloppyDMA(uint32 address, uint16 count);
 void prepare_for_floppyDMA_read();
-void prepare_for_floppyDMA_write();
\ No newline at end of file
+void prepare_for_floppyDMA_write();
+
+void dma_pool_init();
+void *dma_alloc(uint32 bytes);
+void dma_free(void *buffer, uint32 bytes);
+uint32 dma_safe_length(void *address, uint32 bytes);
+
+#endif
\ No newline at end of file
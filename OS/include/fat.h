@@ -1,5 +1,5 @@
 #include "./types.h"
-#include "./fdc.h"
+#include "./blockdev.h"
 
 typedef struct
 {
@@ -29,11 +29,28 @@ typedef struct
 
 } __attribute__((packed)) boot_sector_t;
 
+// Sectors in one FAT
+#define FAT_SECTORS 9
+
+// Clusters the FAT describes, 0 and 1 are reserved and 2-2848 are the data sectors 33-2879 of a 1.44MB floppy
+#define FAT_ENTRIES 2849
+
+// 12 bit entries that fit in one FAT
+#define FAT12_TABLE_ENTRIES (FAT_SECTORS * 512 * 2 / 3)
+
+// On the disk any entry from 0xFF8 up ends a chain, getFatEntry() and friends return FAT_EOF for all of them
+#define FAT12_EOF_MIN 0x0FF8
+#define FAT_EOF 0xFFFF
+
+// Marks a cluster that must not be used
+#define FAT12_BAD 0x0FF7
+
 typedef struct
 {
     // File Allocation Table (FAT)
-    // We will use 16-bits for our entries
-    uint16 entries[2304];
+    // FAT12, 12-bit entries packed two to every three bytes, exactly as on the disk
+    // Use fat12Get/fat12Put (or getFatEntry/setFatEntry for the working copy) to get at entries
+    uint8 bytes[FAT_SECTORS * 512];
 
 } __attribute__((packed)) fat_t;
 
@@ -55,6 +72,25 @@ typedef struct
 
 } __attribute__((packed)) directory_entry_t;
 
+// Directory entry attributes
+#define FILE_ATTRIBUTE_READ_ONLY 0x01
+#define FILE_ATTRIBUTE_HIDDEN 0x02
+#define FILE_ATTRIBUTE_SYSTEM 0x04
+#define FILE_ATTRIBUTE_VOLUME 0x08
+#define FILE_ATTRIBUTE_DIRECTORY 0x10
+#define FILE_ATTRIBUTE_COMPRESSED 0x40     // Reserved in FAT, the data is LZ compressed (see setCompression())
+
+// Clusters of a file that follow each other on the disk
+typedef struct
+{
+    uint16 offset;      // Where the run starts in the file, in clusters
+    uint16 cluster;     // First cluster of the run
+    uint16 length;      // Clusters in the run
+} __attribute__((packed)) file_extent_t;
+
+// Runs kept per open file, more fragmented files fall back to the FAT past the last one
+#define FILE_MAX_EXTENTS 16
+
 typedef struct
 {
     uint8 *startingAddress;
@@ -63,9 +99,18 @@ typedef struct
     // Set to non-zero if opened
     int isOpened;
 
+    // Entry in the kernel's open-file table while the file is open, shared with everyone else who has it open
+    int16 openFile;
+
     // The directory entry for the file, containing all its metadata
     directory_entry_t entry;
 
+    // Where the file's clusters are, built when the file is opened or created and extended as it grows
+    uint16 extentCount;
+    uint16 mappedClusters;  // Clusters covered by the extents
+    int extentsComplete;    // Set to non-zero if the extents cover the whole chain
+    file_extent_t extents[FILE_MAX_EXTENTS];
+
 } __attribute__((packed)) file_t;
 
 typedef struct
@@ -81,15 +126,102 @@ typedef struct
 
 } __attribute__((packed)) directory_t;
 
-void init_fs(directory_t *directory);
+// Different files open at the same time, through openFile() or open()
+#define OPEN_FILE_MAX 8
+
+// Descriptors open at the same time, several can be on the same file
+#define FD_MAX 16
+
+// Sectors each open file keeps in memory
+#define FD_WINDOW_SECTORS 2
+
+// open() flags
+#define O_CREAT 0x01
+
+// lseek() whence
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+
+typedef struct
+{
+    uint32 sequential;  // Cluster reads that followed the chain from the previous one
+    uint32 random;      // Cluster reads that jumped somewhere else
+    uint16 window;      // Clusters currently prefetched ahead of each read
+} readahead_stats_t;
+
+typedef struct
+{
+    uint16 files;
+    uint16 fragmented;  // Files in more than one piece
+    uint16 clusters;    // Clusters in all files
+    uint16 pieces;      // Runs of contiguous clusters in all files
+    uint16 score;       // Breaks between pieces per 100 clusters, 0 if nothing is fragmented
+} fragmentation_t;
+
+typedef struct
+{
+    fragmentation_t before;
+    fragmentation_t after;
+    uint16 moved;       // Files made contiguous
+    uint16 skipped;     // Fragmented files with no free run big enough to move them to
+} defrag_report_t;
+
+typedef struct
+{
+    uint16 files;
+    uint16 fatMismatches;   // Entries that differ between the two FAT copies
+    uint16 crossLinked;     // Chains that run into a cluster another chain already has
+    uint16 truncated;       // Chains that end on a free or invalid entry instead of an end marker
+    uint16 badSize;         // Files whose size doesn't match how many clusters they have
+    uint16 lostClusters;    // Clusters in use that no file owns
+    uint16 repaired;        // Problems fixed in repair mode
+} fsck_report_t;
+
+// device is a block device number, the file system uses the floppy layout on any device
+void init_fs(int device, directory_t *directory);
+void unmount_fs();
 int openDirectory(directory_t *directory);
 int openFile(file_t *file);
-void closeFile(file_t *file);
-int createDirectory(directory_t *directory);
+int closeFile(file_t *file);
+int flushFile(file_t *file);
+int setCompression(file_t *file, int compressed);
+int createDirectory(directory_t *directory, directory_t *parent);
 int createFile(file_t *file, directory_t *parent);
-void deleteDirectory(directory_t *file);
+int deleteDirectory(directory_t *directory, directory_t *parent);
 void deleteFile(file_t *file, directory_t *parent);
+int readCluster(uint16 cluster, void *address);
+void getReadaheadStats(readahead_stats_t *stats);
+uint16 allocateCluster();
+int claimCluster(uint16 cluster);
+uint16 allocateRun(uint16 count, uint16 *length);
+int extendChain(uint16 last, uint16 count, file_t *file);
+int preallocateFile(file_t *file, uint32 size);
+void appendExtent(file_t *file, uint16 cluster, uint16 length);
+void buildExtentMap(file_t *file);
+uint16 fileCluster(file_t *file, uint16 index);
+uint32 fileOffsetToLba(file_t *file, uint32 offset);
+uint16 clusterCount(file_t *file);
+void freeCluster(uint16 cluster);
+uint16 fat12Get(fat_t *fat, uint16 cluster);
+int fat12Put(fat_t *fat, uint16 cluster, uint16 value);
+void fat12Decode(fat_t *fat, uint16 first, uint16 count, uint16 *entries);
+uint16 getFatEntry(uint16 cluster);
+void setFatEntry(uint16 cluster, uint16 value);
+void syncFAT();
+uint16 getFreeClusterCount();
 uint8 readByte(file_t *file, uint32 index);
 int writeByte(file_t *file, uint8 byte, uint32 index);
+int open(directory_t *parent, char *filename, char *ext, int flags);
+int read(int fd, void *buffer, uint32 count);
+int write(int fd, void *buffer, uint32 count);
+int32 lseek(int fd, int32 offset, int whence);
+int close(int fd);
+int openPath(char *path, int flags);
+int lookupPath(char *path, directory_entry_t *entry);
+int makeDirectory(char *path);
+void measureFragmentation(fragmentation_t *report);
+int defragment(uint16 maxFiles, defrag_report_t *report);
+int checkFilesystem(int repair, fsck_report_t *report);
 int findFile(char *filename, char* ext, directory_t directory, directory_entry_t *foundEntry);
 int stringcompare(char *string0, char *string1, int length);
\ No newline at end of file
@@ -1,6 +1,51 @@
+#ifndef FDC_H
+#define FDC_H
+
 #include "./types.h"
+#include "./blockdev.h"
 #include "io.h" // Errata
+
+// 1.44MB 3.5" geometry
+#define FLOPPY_SECTOR_SIZE BLOCK_SIZE
+#define FLOPPY_SECTORS_PER_TRACK 18
+#define FLOPPY_HEADS 2
+
+// Order in which pending requests are given to the controller
+typedef enum
+{
+    FLOPPY_SCHED_FIFO,      // Submission order
+    FLOPPY_SCHED_CSCAN      // One-way sweep by cylinder and head
+} floppy_scheduler_t;
+
+typedef struct
+{
+    uint32 commands;        // Read/write commands given to the controller
+    uint32 merged;          // Requests that rode along in another request's command
+    uint32 seekDistance;    // Cylinders travelled by the heads between commands
+} floppy_sched_stats_t;
+
 void floppy_detect_drives();
 int floppy_init();
+
+// Install the IRQ6 handler that drives the request queue and register drive 0 as block device fd0
+void floppy_install();
+
+// Queue a request, the caller must fill in type, drive, lba, address and count
+// These and floppy_wait/floppy_plug/floppy_unplug are the asynchronous side of the fd0 block device
+void floppy_submit(block_request_t *request);
+
+// Sleep until a submitted request is finished, returns its result
+int floppy_wait(block_request_t *request);
+
+// Hold back dispatching while a batch of requests is submitted, so the scheduler sees all of them
+void floppy_plug();
+void floppy_unplug();
+
+void floppy_set_scheduler(floppy_scheduler_t policy);
+void floppy_get_sched_stats(floppy_sched_stats_t *stats);
+
+// Read or write count sectors starting at lba, address can be anywhere in memory
 int floppy_read(int drive, uint32 lba, void* address, uint16 count);
-int floppy_write(int drive, uint32 lba, void* address, uint16 count);
\ No newline at end of file
+int floppy_write(int drive, uint32 lba, void* address, uint16 count);
+
+#endif
\ No newline at end of file
@@ -12,6 +12,7 @@ typedef enum
 {
 	PROC_READY, 		// The process is ready, but waits for OS to dispatch
   PROC_RUNNING, 	// The process is executing on CPU but can be interrupted
+	PROC_WAITING,		// The process is asleep until an interrupt wakes it up
 	PROC_TERMINATED // Process was finished or forcefully terminated
 } proc_status_t;
 
@@ -49,4 +50,7 @@ void runproc(proc_t proc);
 void yield();
 void switchcontext();
 void exit();
+int getpid();
+int block();
+void unblock(int pid);
 void banner();
\ No newline at end of file
@@ -0,0 +1,35 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include "./types.h"
+
+// https://wiki.osdev.org/PCI#Configuration_Space_Access_Mechanism_.231
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+// Offsets into a function's configuration space
+#define PCI_VENDOR_ID 0x00
+#define PCI_COMMAND 0x04
+#define PCI_CLASS 0x08
+#define PCI_BAR4 0x20
+
+// Bits of the command register
+#define PCI_COMMAND_IO 0x01
+#define PCI_COMMAND_BUS_MASTER 0x04
+
+// Location of a function on the bus
+typedef struct
+{
+    uint8 bus;
+    uint8 slot;
+    uint8 function;
+} pci_device_t;
+
+uint32 pci_read(pci_device_t device, uint8 offset);
+void pci_write(pci_device_t device, uint8 offset, uint32 value);
+
+// Find the first function on bus 0 with the given class and subclass
+// Returns 0 and fills in device if one was found, -1 otherwise
+int pci_find_class(uint8 classCode, uint8 subclass, pci_device_t *device);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include "./types.h"
+#include "./blockdev.h"
+
+// RAM disks live above 1MB, out of the way of everything the kernel places in low memory
+#define RAMDISK_ADDRESS 0x100000
+
+// Enough for a whole 1.44MB floppy
+#define RAMDISK_MAX_SECTORS 2880
+
+#define RAMDISK_MAX_DISKS 2
+
+// Enables the A20 line, must run before any RAM disk is made
+void ramdisk_init();
+
+// Register the memory [base, base + sectorCount * 512) as a block device (rd0, rd1)
+// Returns the device number, or -1 if no more RAM disks can be made
+int ramdisk_create(void *base, uint32 sectorCount);
+
+// Fill a RAM disk with the first sectors of another block device, interrupts must be on
+// if that device needs them
+int ramdisk_load(int device, int source);
+
+int ramdisk_read(int disk, uint32 lba, void *address, uint16 count);
+int ramdisk_write(int disk, uint32 lba, void *address, uint16 count);
+
+#endif
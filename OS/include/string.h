@@ -1,4 +1,5 @@
 int stringcompare(char *string0, char *string1, int length);
 void printFileName(directory_entry_t *entry);
 void scanfWithPadding(char *string, char paddingChar, int length);
-void stringcopy(char *src, char *dest, int length);
\ No newline at end of file
+void stringcopy(char *src, char *dest, int length);
+void* memcpy(void* dest, void* src, uint32 count);
\ No newline at end of file
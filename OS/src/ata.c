@@ -0,0 +1,524 @@
+#include "./types.h"
+#include "./io.h"
+#include "./irq.h"
+#include "./dma.h"
+#include "./pci.h"
+#include "./ata.h"
+#include "./multitasking.h"
+
+/*
+ * ATA/IDE hard disk driver
+ * https://wiki.osdev.org/ATA_PIO_Mode
+ * https://wiki.osdev.org/ATA/ATAPI_using_DMA
+ *
+ * Drives are addressed with 28 bit LBA, which covers 128GB.
+ * PIO transfers use READ/WRITE MULTIPLE when the drive supports it, so the drive asks for
+ * data once per block of sectors rather than once per sector.
+ * When the PCI IDE controller can bus master, transfers go by DMA instead: the controller
+ * walks a physical region descriptor table (PRDT) and the CPU sleeps until IRQ14/15.
+ * Bus-master DMA reaches all 4GB and only needs regions split at 64KB boundaries, so it
+ * works straight on the caller's memory without a bounce buffer.
+ */
+
+// Offsets from a channel's command block registers
+enum AtaRegisters
+{
+    ATA_REG_DATA            = 0,
+    ATA_REG_ERROR           = 1, // read-only
+    ATA_REG_SECTOR_COUNT    = 2,
+    ATA_REG_LBA_LOW         = 3,
+    ATA_REG_LBA_MID         = 4,
+    ATA_REG_LBA_HIGH        = 5,
+    ATA_REG_DRIVE           = 6,
+    ATA_REG_STATUS          = 7, // read-only
+    ATA_REG_COMMAND         = 7  // write-only
+};
+
+enum AtaCommands
+{
+    ATA_CMD_READ_PIO        = 0x20,
+    ATA_CMD_WRITE_PIO       = 0x30,
+    ATA_CMD_READ_MULTIPLE   = 0xC4,
+    ATA_CMD_WRITE_MULTIPLE  = 0xC5,
+    ATA_CMD_SET_MULTIPLE    = 0xC6,
+    ATA_CMD_READ_DMA        = 0xC8,
+    ATA_CMD_WRITE_DMA       = 0xCA,
+    ATA_CMD_FLUSH_CACHE     = 0xE7,
+    ATA_CMD_IDENTIFY        = 0xEC
+};
+
+// Status register bits
+#define ATA_SR_BSY 0x80
+#define ATA_SR_DF 0x20
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_ERR 0x01
+
+// Bus master registers, offsets from the channel's part of BAR4
+#define ATA_BM_COMMAND 0
+#define ATA_BM_STATUS 2
+#define ATA_BM_PRDT 4
+
+#define ATA_BM_START 0x01
+#define ATA_BM_READ 0x08    // Direction bit, set when the controller writes to memory
+#define ATA_BM_ERROR 0x02
+#define ATA_BM_IRQ 0x04
+
+// Marks the last entry of a PRDT
+#define ATA_PRD_END 0x80000000
+
+// Polls of the status register before a drive is given up on
+#define ATA_TIMEOUT 1000000
+
+typedef struct
+{
+    uint16 base;            // Command block registers
+    uint16 control;         // Alternate status / device control register
+    uint16 busMaster;       // Bus master registers (0 without a bus-master controller)
+    int irq;
+    uint32 *prdt;           // Two words per region: address, then byte count (0 means 64KB)
+    int busy;               // Set while a process owns the channel
+    volatile int irqFired;
+    int waiter;             // pid of the process sleeping on the channel's interrupt
+} ata_channel_t;
+
+typedef struct
+{
+    int present;
+    int channel;
+    int slave;
+    int dma;                // Set if the drive does multiword DMA
+    uint16 multiple;        // Sectors per READ/WRITE MULTIPLE block (0 if not supported)
+    blockdev_t device;
+} ata_drive_t;
+
+// The statics below live in .bss, which nothing clears for us, so ata_install() must run before use
+static ata_channel_t channels[2];
+static ata_drive_t drives[ATA_MAX_DRIVES];
+static ata_mode_t mode;
+static ata_stats_t ataStats;
+static char *driveNames[ATA_MAX_DRIVES] = { "hd0", "hd1", "hd2", "hd3" };
+
+// Reading the alternate status register takes about 100ns, four reads give a drive the
+// 400ns it needs after a select or a command before its status can be trusted
+static void ata_delay(ata_channel_t *channel)
+{
+    for(int i = 0; i < 4; i++)
+        inb(channel->control);
+}
+
+// Returns the status once BSY clears, or -1 on a timeout
+static int ata_wait_ready(ata_channel_t *channel)
+{
+    for(int i = 0; i < ATA_TIMEOUT; i++)
+    {
+        uint8 status = inb(channel->base + ATA_REG_STATUS);
+        if(!(status & ATA_SR_BSY))
+            return status;
+    }
+
+    return -1;
+}
+
+// Wait until the drive wants data moved, returns -1 on an error or a timeout
+static int ata_wait_data(ata_channel_t *channel)
+{
+    int status = ata_wait_ready(channel);
+
+    if(status < 0 || (status & (ATA_SR_ERR | ATA_SR_DF)) || !(status & ATA_SR_DRQ))
+        return -1;
+
+    return 0;
+}
+
+// Wait for the drive to finish a command, returns -1 if it failed
+static int ata_wait_done(ata_channel_t *channel)
+{
+    int status = ata_wait_ready(channel);
+
+    if(status < 0 || (status & (ATA_SR_ERR | ATA_SR_DF)))
+        return -1;
+
+    return 0;
+}
+
+// Sleep until the channel raises its interrupt
+static void ata_wait_irq(ata_channel_t *channel)
+{
+    uint32 eflags;
+    asm volatile("pushfl; pop %0; cli" : "=r"(eflags));
+
+    while(!channel->irqFired)
+    {
+        // Same as floppy_wait(): user processes sleep, the kernel halts
+        if(block() < 0)
+            asm volatile("sti; hlt; cli");
+    }
+
+    if(eflags & 0x200)
+        asm volatile("sti");
+}
+
+// Processes share a channel's registers, so only one of them may use it at a time
+static void ata_acquire(ata_channel_t *channel)
+{
+    while(channel->busy)
+        yield();
+    channel->busy = 1;
+}
+
+static void ata_release(ata_channel_t *channel)
+{
+    channel->busy = 0;
+}
+
+static void ata_irq(ata_channel_t *channel)
+{
+    // Reading the status register acknowledges the interrupt on the drive's side
+    inb(channel->base + ATA_REG_STATUS);
+
+    if(channel->busMaster)
+        outb(channel->busMaster + ATA_BM_STATUS, ATA_BM_IRQ);
+
+    channel->irqFired = 1;
+    unblock(channel->waiter);
+}
+
+void ata_primary_irq_handler(regs *r)
+{
+    (void) r;
+    ata_irq(&channels[0]);
+}
+
+void ata_secondary_irq_handler(regs *r)
+{
+    (void) r;
+    ata_irq(&channels[1]);
+}
+
+// Select the drive and load the LBA and sector count registers (a count of 256 is sent as 0)
+static void ata_setup(ata_drive_t *drive, uint32 lba, uint16 count)
+{
+    ata_channel_t *channel = &channels[drive->channel];
+
+    outb(channel->base + ATA_REG_DRIVE, 0xE0 | (drive->slave << 4) | ((lba >> 24) & 0x0F));
+    ata_delay(channel);
+
+    outb(channel->base + ATA_REG_SECTOR_COUNT, (uint8) count);
+    outb(channel->base + ATA_REG_LBA_LOW, (uint8) lba);
+    outb(channel->base + ATA_REG_LBA_MID, (uint8) (lba >> 8));
+    outb(channel->base + ATA_REG_LBA_HIGH, (uint8) (lba >> 16));
+}
+
+// One PIO command for up to 256 sectors
+static int ata_pio(ata_drive_t *drive, uint32 lba, uint16 *words, uint16 count, int write)
+{
+    ata_channel_t *channel = &channels[drive->channel];
+    uint16 block = drive->multiple ? drive->multiple : 1;
+
+    ata_setup(drive, lba, count);
+
+    if(drive->multiple)
+        outb(channel->base + ATA_REG_COMMAND, write ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_READ_MULTIPLE);
+    else
+        outb(channel->base + ATA_REG_COMMAND, write ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO);
+
+    ata_delay(channel);
+    ataStats.pioCommands++;
+
+    // The drive raises DRQ once per block and takes or hands over the whole block at once
+    for(uint16 done = 0; done < count; done += block)
+    {
+        uint16 sectors = count - done < block ? count - done : block;
+
+        if(ata_wait_data(channel) < 0)
+            return -1;
+
+        for(uint32 i = 0; i < sectors * 256; i++)
+        {
+            if(write)
+                outw(channel->base + ATA_REG_DATA, words[i]);
+            else
+                words[i] = inw(channel->base + ATA_REG_DATA);
+        }
+
+        words += sectors * 256;
+    }
+
+    return write ? ata_wait_done(channel) : 0;
+}
+
+// One bus-master DMA command for up to ATA_MAX_COMMAND_SECTORS sectors
+static int ata_dma(ata_drive_t *drive, uint32 lba, uint8 *address, uint16 count, int write)
+{
+    ata_channel_t *channel = &channels[drive->channel];
+    uint32 start = (uint32) address;
+    uint32 bytes = count * BLOCK_SIZE;
+    int regions = 0;
+
+    // A region may not cross a 64KB boundary
+    while(bytes > 0)
+    {
+        uint32 length = 0x10000 - (start & 0xFFFF);
+        if(length > bytes)
+            length = bytes;
+
+        channel->prdt[regions * 2] = start;
+        channel->prdt[regions * 2 + 1] = length & 0xFFFF;
+        regions++;
+
+        start += length;
+        bytes -= length;
+    }
+    channel->prdt[regions * 2 - 1] |= ATA_PRD_END;
+
+    uint8 direction = write ? 0 : ATA_BM_READ;
+    outb(channel->busMaster + ATA_BM_COMMAND, 0);
+    outl(channel->busMaster + ATA_BM_PRDT, (uint32) channel->prdt);
+    outb(channel->busMaster + ATA_BM_STATUS, ATA_BM_IRQ | ATA_BM_ERROR);
+    outb(channel->busMaster + ATA_BM_COMMAND, direction);
+
+    ata_setup(drive, lba, count);
+
+    channel->irqFired = 0;
+    channel->waiter = getpid();
+    outb(channel->base + ATA_REG_COMMAND, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+    outb(channel->busMaster + ATA_BM_COMMAND, direction | ATA_BM_START);
+    ataStats.dmaCommands++;
+
+    ata_wait_irq(channel);
+    channel->waiter = -1;
+
+    outb(channel->busMaster + ATA_BM_COMMAND, 0);
+
+    if(inb(channel->busMaster + ATA_BM_STATUS) & ATA_BM_ERROR)
+        return -1;
+
+    return ata_wait_done(channel);
+}
+
+// Transfer the LBA range [lba, lba + count) to or from memory, count is in sectors
+static int ata_transfer(int index, uint32 lba, uint8 *address, uint16 count, int write)
+{
+    if(index < 0 || index >= ATA_MAX_DRIVES || !drives[index].present)
+        return -1;
+
+    ata_drive_t *drive = &drives[index];
+    ata_channel_t *channel = &channels[drive->channel];
+
+    // The controller can only start a region on an even address
+    int dma = mode == ATA_MODE_DMA && drive->dma && channel->busMaster && !((uint32) address & 1);
+    int result = 0;
+
+    ata_acquire(channel);
+
+    while(count > 0 && result == 0)
+    {
+        uint16 chunk = count < ATA_MAX_COMMAND_SECTORS ? count : ATA_MAX_COMMAND_SECTORS;
+
+        if(ata_wait_ready(channel) < 0)
+            result = -1;
+        else if(dma)
+            result = ata_dma(drive, lba, address, chunk, write);
+        else
+            result = ata_pio(drive, lba, (uint16 *) address, chunk, write);
+
+        if(result == 0)
+            ataStats.sectors += chunk;
+        lba += chunk;
+        address += chunk * BLOCK_SIZE;
+        count -= chunk;
+    }
+
+    ata_release(channel);
+
+    return result;
+}
+
+int ata_read(int drive, uint32 lba, void *address, uint16 count)
+{
+    int result = ata_transfer(drive, lba, (uint8 *) address, count, 0);
+    if(result < 0)
+        printf("Error reading disk!");
+    return result;
+}
+
+int ata_write(int drive, uint32 lba, void *address, uint16 count)
+{
+    int result = ata_transfer(drive, lba, (uint8 *) address, count, 1);
+    if(result < 0)
+        printf("Error writing disk!");
+    return result;
+}
+
+int ata_flush(int index)
+{
+    if(index < 0 || index >= ATA_MAX_DRIVES || !drives[index].present)
+        return -1;
+
+    ata_drive_t *drive = &drives[index];
+    ata_channel_t *channel = &channels[drive->channel];
+
+    ata_acquire(channel);
+
+    outb(channel->base + ATA_REG_DRIVE, 0xE0 | (drive->slave << 4));
+    ata_delay(channel);
+    outb(channel->base + ATA_REG_COMMAND, ATA_CMD_FLUSH_CACHE);
+    ata_delay(channel);
+    int result = ata_wait_done(channel);
+
+    ata_release(channel);
+
+    return result;
+}
+
+// Ask a drive who it is, returns -1 if there is no ATA drive in that position
+static int ata_identify(ata_drive_t *drive)
+{
+    ata_channel_t *channel = &channels[drive->channel];
+    uint16 identity[256];
+
+    outb(channel->base + ATA_REG_DRIVE, 0xA0 | (drive->slave << 4));
+    ata_delay(channel);
+    outb(channel->base + ATA_REG_SECTOR_COUNT, 0);
+    outb(channel->base + ATA_REG_LBA_LOW, 0);
+    outb(channel->base + ATA_REG_LBA_MID, 0);
+    outb(channel->base + ATA_REG_LBA_HIGH, 0);
+    outb(channel->base + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    ata_delay(channel);
+
+    // 0 means nobody is there, 0xFF means the channel itself is missing
+    uint8 status = inb(channel->base + ATA_REG_STATUS);
+    if(status == 0 || status == 0xFF)
+        return -1;
+
+    if(ata_wait_ready(channel) < 0)
+        return -1;
+
+    // ATAPI and SATA devices put a signature here and abort the command
+    if(inb(channel->base + ATA_REG_LBA_MID) || inb(channel->base + ATA_REG_LBA_HIGH))
+        return -1;
+
+    if(ata_wait_data(channel) < 0)
+        return -1;
+
+    for(int i = 0; i < 256; i++)
+        identity[i] = inw(channel->base + ATA_REG_DATA);
+
+    // Word 49 bit 9: LBA, bit 8: DMA
+    if(!(identity[49] & 0x200))
+        return -1;
+
+    drive->dma = (identity[49] & 0x100) != 0;
+    drive->device.sectorCount = identity[60] | ((uint32) identity[61] << 16);
+
+    // Word 47 holds the most sectors per READ/WRITE MULTIPLE block
+    drive->multiple = identity[47] & 0xFF;
+    if(drive->multiple > 0)
+    {
+        outb(channel->base + ATA_REG_SECTOR_COUNT, (uint8) drive->multiple);
+        outb(channel->base + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+        ata_delay(channel);
+        if(ata_wait_done(channel) < 0)
+            drive->multiple = 0;
+    }
+
+    return 0;
+}
+
+// Look for a PCI IDE controller that can bus master and give each channel its registers and PRDT
+static void ata_find_bus_master()
+{
+    pci_device_t controller;
+
+    channels[0].busMaster = 0;
+    channels[1].busMaster = 0;
+
+    // Class 1 (mass storage), subclass 1 (IDE), programming interface bit 7 is bus mastering
+    if(pci_find_class(0x01, 0x01, &controller) < 0)
+        return;
+    if(!((pci_read(controller, PCI_CLASS) >> 8) & 0x80))
+        return;
+
+    uint32 bar4 = pci_read(controller, PCI_BAR4);
+    if(!(bar4 & 1))
+        return; // Only I/O space registers are handled
+
+    // The upper half is the status register, writing zeros there leaves it alone
+    uint32 command = pci_read(controller, PCI_COMMAND) & 0xFFFF;
+    pci_write(controller, PCI_COMMAND, command | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+    for(int i = 0; i < 2; i++)
+    {
+        // A pool block never crosses a 64KB boundary, which is all a PRDT asks for
+        channels[i].prdt = (uint32 *) dma_alloc(DMA_POOL_BLOCK_SIZE);
+        if(channels[i].prdt)
+            channels[i].busMaster = (bar4 & 0xFFFC) + i * 8;
+    }
+}
+
+int ata_install()
+{
+    int found = 0;
+
+    channels[0].base = 0x1F0;
+    channels[0].control = 0x3F6;
+    channels[0].irq = 14;
+    channels[1].base = 0x170;
+    channels[1].control = 0x376;
+    channels[1].irq = 15;
+
+    for(int i = 0; i < 2; i++)
+    {
+        channels[i].busy = 0;
+        channels[i].irqFired = 0;
+        channels[i].waiter = -1;
+
+        // Clear nIEN so the drives raise their interrupts
+        outb(channels[i].control, 0);
+    }
+
+    irq_install_handler(channels[0].irq, ata_primary_irq_handler);
+    irq_install_handler(channels[1].irq, ata_secondary_irq_handler);
+
+    mode = ATA_MODE_DMA;
+    ataStats.pioCommands = 0;
+    ataStats.dmaCommands = 0;
+    ataStats.sectors = 0;
+
+    ata_find_bus_master();
+
+    for(int i = 0; i < ATA_MAX_DRIVES; i++)
+    {
+        ata_drive_t *drive = &drives[i];
+        drive->channel = i / 2;
+        drive->slave = i % 2;
+        drive->present = ata_identify(drive) == 0;
+
+        if(!drive->present)
+            continue;
+
+        drive->device.name = driveNames[i];
+        drive->device.unit = i;
+        drive->device.read = ata_read;
+        drive->device.write = ata_write;
+        drive->device.flush = ata_flush;
+        drive->device.submit = 0;
+        drive->device.wait = 0;
+        drive->device.plug = 0;
+        drive->device.unplug = 0;
+        blockdev_register(&drive->device);
+        found++;
+    }
+
+    return found;
+}
+
+void ata_set_mode(ata_mode_t newMode)
+{
+    mode = newMode;
+}
+
+void ata_get_stats(ata_stats_t *stats)
+{
+    *stats = ataStats;
+}
@@ -0,0 +1,146 @@
+#include "./types.h"
+#include "./blockdev.h"
+
+// Block device table
+// The cache and the file system only ever talk to a device number, the table maps it
+// to the backend (floppy, ATA, ...) that owns the drive
+
+static blockdev_t *devices[BLOCKDEV_MAX];
+static int deviceCount;
+
+void blockdev_init()
+{
+    deviceCount = 0;
+}
+
+int blockdev_register(blockdev_t *device)
+{
+    if(deviceCount == BLOCKDEV_MAX)
+        return -1;
+
+    devices[deviceCount] = device;
+    return deviceCount++;
+}
+
+int blockdev_find(char *name)
+{
+    for(int i = 0; i < deviceCount; i++)
+    {
+        int j = 0;
+        while(name[j] && name[j] == devices[i]->name[j])
+            j++;
+
+        if(name[j] == devices[i]->name[j])
+            return i;
+    }
+
+    return -1;
+}
+
+int blockdev_count()
+{
+    return deviceCount;
+}
+
+blockdev_t *blockdev_get(int device)
+{
+    if(device < 0 || device >= deviceCount)
+        return 0;
+
+    return devices[device];
+}
+
+// Returns the device if [lba, lba + count) lies on it
+static blockdev_t *blockdev_check(int device, uint32 lba, uint16 count)
+{
+    blockdev_t *dev = blockdev_get(device);
+
+    if(!dev || lba + count > dev->sectorCount)
+        return 0;
+
+    return dev;
+}
+
+int blockdev_read(int device, uint32 lba, void *address, uint16 count)
+{
+    blockdev_t *dev = blockdev_check(device, lba, count);
+
+    if(!dev)
+        return -1;
+
+    return dev->read(dev->unit, lba, address, count);
+}
+
+int blockdev_write(int device, uint32 lba, void *address, uint16 count)
+{
+    blockdev_t *dev = blockdev_check(device, lba, count);
+
+    if(!dev)
+        return -1;
+
+    return dev->write(dev->unit, lba, address, count);
+}
+
+int blockdev_flush(int device)
+{
+    blockdev_t *dev = blockdev_get(device);
+
+    if(!dev)
+        return -1;
+
+    return dev->flush ? dev->flush(dev->unit) : 0;
+}
+
+void blockdev_submit(int device, block_request_t *request)
+{
+    blockdev_t *dev = blockdev_check(device, request->lba, request->count);
+
+    if(!dev)
+    {
+        request->result = -1;
+        request->state = BLOCK_REQUEST_FAILED;
+        return;
+    }
+
+    request->drive = dev->unit;
+
+    if(dev->submit)
+    {
+        dev->submit(request);
+        return;
+    }
+
+    // No queue behind this device, so the request is finished before it is "waited" for
+    if(request->type == BLOCK_REQUEST_WRITE)
+        request->result = dev->write(dev->unit, request->lba, request->address, request->count);
+    else
+        request->result = dev->read(dev->unit, request->lba, request->address, request->count);
+
+    request->state = request->result < 0 ? BLOCK_REQUEST_FAILED : BLOCK_REQUEST_DONE;
+}
+
+int blockdev_wait(int device, block_request_t *request)
+{
+    blockdev_t *dev = blockdev_get(device);
+
+    if(dev && dev->wait)
+        return dev->wait(request);
+
+    return request->result;
+}
+
+void blockdev_plug(int device)
+{
+    blockdev_t *dev = blockdev_get(device);
+
+    if(dev && dev->plug)
+        dev->plug();
+}
+
+void blockdev_unplug(int device)
+{
+    blockdev_t *dev = blockdev_get(device);
+
+    if(dev && dev->unplug)
+        dev->unplug();
+}
@@ -0,0 +1,654 @@
+#include "./types.h"
+#include "./cache.h"
+#include "./blockdev.h"
+#include "./dma.h"
+#include "./fat.h"
+#include "./string.h"
+#include "./multitasking.h"
+
+// Block buffer cache sitting between the file system and the block devices
+// Sectors are keyed by (drive, LBA) and found through a small hash table
+// Every block is also on a doubly linked LRU list, the most recently used block is at the front
+// and the block at the back is the one that gets reused when a new sector needs a buffer
+// In write-back mode blocks can be dirty, a dirty block is written out before its buffer is reused
+// Read-ahead fills blocks in the background, such a block is busy until its read finishes
+// and anyone looking it up before then waits for the read
+
+typedef struct
+{
+    int drive;
+    uint32 lba;
+    int valid;          // Set to non-zero when the buffer holds the sector (drive, lba)
+    int dirty;          // Set to non-zero when the buffer is newer than the disk
+    int busy;           // Set to non-zero while a read or write of the buffer is in flight
+    int prefetched;     // Set to non-zero when read-ahead filled the buffer and nobody used it yet
+    int16 prefetch;     // Slot in prefetchRequests reading this block (-1 if none)
+    int16 prev;         // Neighbour towards the most recently used end (-1 if none)
+    int16 next;         // Neighbour towards the least recently used end (-1 if none)
+    int16 hashNext;     // Next block in the same hash bucket (-1 if none)
+} cache_block_t;
+
+// The statics below live in .bss, which nothing clears for us, so cache_init() must run before use
+static cache_block_t blocks[CACHE_MAX_BLOCKS];
+static int16 buckets[CACHE_HASH_BUCKETS];
+static int16 mostRecent;
+static int16 leastRecent;
+static int blockCount;
+static int writeBack;
+static int syncing;
+static block_request_t syncRequests[CACHE_MAX_BLOCKS];
+static block_request_t prefetchRequests[CACHE_PREFETCH_SLOTS];
+static int16 prefetchBlocks[CACHE_PREFETCH_SLOTS];  // Block each slot reads into (-1 if the slot is free)
+static uint8 *prefetchBuffer;   // Read-ahead runs for devices without a request queue land here first
+static cache_stats_t stats;
+
+static void cache_drop(int16 block);
+
+static uint8 *cache_buffer(int16 block)
+{
+    return (uint8 *) CACHE_BUFFER_ADDRESS + block * BLOCK_SIZE;
+}
+
+static int cache_hash(int drive, uint32 lba)
+{
+    return (lba + drive * 7) % CACHE_HASH_BUCKETS;
+}
+
+// Take a block out of the LRU list
+static void cache_unlink(int16 block)
+{
+    if(blocks[block].prev >= 0)
+        blocks[blocks[block].prev].next = blocks[block].next;
+    else
+        mostRecent = blocks[block].next;
+
+    if(blocks[block].next >= 0)
+        blocks[blocks[block].next].prev = blocks[block].prev;
+    else
+        leastRecent = blocks[block].prev;
+
+    blocks[block].prev = -1;
+    blocks[block].next = -1;
+}
+
+// Put a block at the most recently used end of the LRU list
+static void cache_push_front(int16 block)
+{
+    blocks[block].prev = -1;
+    blocks[block].next = mostRecent;
+
+    if(mostRecent >= 0)
+        blocks[mostRecent].prev = block;
+    else
+        leastRecent = block;
+
+    mostRecent = block;
+}
+
+// Put a block at the least recently used end of the LRU list, so it is the next one reused
+static void cache_push_back(int16 block)
+{
+    blocks[block].next = -1;
+    blocks[block].prev = leastRecent;
+
+    if(leastRecent >= 0)
+        blocks[leastRecent].next = block;
+    else
+        mostRecent = block;
+
+    leastRecent = block;
+}
+
+static void cache_touch(int16 block)
+{
+    if(block == mostRecent)
+        return;
+
+    cache_unlink(block);
+    cache_push_front(block);
+}
+
+static void cache_hash_remove(int16 block)
+{
+    int bucket = cache_hash(blocks[block].drive, blocks[block].lba);
+    int16 *link = &buckets[bucket];
+
+    while(*link >= 0)
+    {
+        if(*link == block)
+        {
+            *link = blocks[block].hashNext;
+            break;
+        }
+        link = &blocks[*link].hashNext;
+    }
+
+    blocks[block].hashNext = -1;
+}
+
+// Returns the block holding (drive, lba), or -1 if the sector is not cached
+static int16 cache_lookup(int drive, uint32 lba)
+{
+    int16 block = buckets[cache_hash(drive, lba)];
+
+    while(block >= 0)
+    {
+        if(blocks[block].drive == drive && blocks[block].lba == lba)
+            return block;
+        block = blocks[block].hashNext;
+    }
+
+    return -1;
+}
+
+// The block is busy while the write is in flight, so nobody changes or reuses its buffer meanwhile
+static int cache_write_block(int16 block)
+{
+    blocks[block].busy = 1;
+    int result = blockdev_write(blocks[block].drive, blocks[block].lba, cache_buffer(block), 1);
+    blocks[block].busy = 0;
+
+    if(result == 0)
+    {
+        blocks[block].dirty = 0;
+        stats.writebacks++;
+    }
+
+    return result;
+}
+
+// Wait for the read-ahead in a slot and settle its block
+static void cache_finish_prefetch(int slot)
+{
+    int16 block = prefetchBlocks[slot];
+    int result = blockdev_wait(blocks[block].drive, &prefetchRequests[slot]);
+
+    prefetchBlocks[slot] = -1;
+    blocks[block].busy = 0;
+    blocks[block].prefetch = -1;
+
+    if(result < 0)
+        cache_drop(block);
+}
+
+// Settle every read-ahead that already finished
+static void cache_reap()
+{
+    for(int slot = 0; slot < CACHE_PREFETCH_SLOTS; slot++)
+    {
+        if(prefetchBlocks[slot] < 0)
+            continue;
+
+        block_request_state_t state = prefetchRequests[slot].state;
+        if(state == BLOCK_REQUEST_DONE || state == BLOCK_REQUEST_FAILED)
+            cache_finish_prefetch(slot);
+    }
+}
+
+// Like cache_lookup(), but waits for a read-ahead still filling the block
+static int16 cache_find(int drive, uint32 lba)
+{
+    int16 block = cache_lookup(drive, lba);
+
+    if(block >= 0 && blocks[block].prefetch >= 0)
+    {
+        cache_finish_prefetch(blocks[block].prefetch);
+        block = cache_lookup(drive, lba);
+    }
+
+    return block;
+}
+
+// Like cache_find(), but also waits for a write of the block still in flight,
+// so the buffer can be changed or dropped once this returns
+static int16 cache_find_idle(int drive, uint32 lba)
+{
+    int16 block = cache_find(drive, lba);
+
+    while(block >= 0 && blocks[block].busy)
+    {
+        yield();
+        block = cache_find(drive, lba);
+    }
+
+    return block;
+}
+
+// Returns an idle block for (drive, lba) and makes it the most recently used
+// If the sector is cached already that block is returned and *fresh is cleared, otherwise the least
+// recently used block that is not busy is reused for it and *fresh is set
+// Writing back a dirty block may sleep, and another process may cache (drive, lba) meanwhile,
+// so the hash is looked up again after every write-back
+// With clean set dirty blocks are passed over instead of written back, for callers that have a
+// device plugged and must not wait on it
+// Returns -1 if there is no block to reuse or it was dirty and could not be written back
+static int16 cache_get(int drive, uint32 lba, int *fresh, int clean)
+{
+    int16 block;
+
+    while(1)
+    {
+        block = cache_find_idle(drive, lba);
+
+        if(block >= 0)
+        {
+            *fresh = 0;
+            cache_touch(block);
+            return block;
+        }
+
+        block = leastRecent;
+        while(block >= 0 && (blocks[block].busy || (clean && blocks[block].dirty)))
+            block = blocks[block].prev;
+
+        if(block < 0)
+            return -1;
+
+        if(!blocks[block].dirty)
+            break;
+
+        if(cache_write_block(block) < 0)
+            return -1;
+    }
+
+    if(blocks[block].valid)
+    {
+        cache_hash_remove(block);
+        stats.evictions++;
+    }
+
+    int bucket = cache_hash(drive, lba);
+    blocks[block].drive = drive;
+    blocks[block].lba = lba;
+    blocks[block].valid = 1;
+    blocks[block].prefetched = 0;
+    blocks[block].hashNext = buckets[bucket];
+    buckets[bucket] = block;
+
+    cache_touch(block);
+
+    *fresh = 1;
+    return block;
+}
+
+static void cache_drop(int16 block)
+{
+    cache_hash_remove(block);
+    blocks[block].valid = 0;
+    blocks[block].dirty = 0;
+    blocks[block].prefetched = 0;
+    cache_unlink(block);
+    cache_push_back(block);
+}
+
+void cache_init(uint32 budget)
+{
+    blockCount = budget / BLOCK_SIZE;
+    if(blockCount < 1)
+        blockCount = 1;
+    if(blockCount > CACHE_MAX_BLOCKS)
+        blockCount = CACHE_MAX_BLOCKS;
+
+    for(int i = 0; i < CACHE_HASH_BUCKETS; i++)
+        buckets[i] = -1;
+
+    mostRecent = -1;
+    leastRecent = -1;
+    writeBack = 0;
+    syncing = 0;
+
+    for(int slot = 0; slot < CACHE_PREFETCH_SLOTS; slot++)
+        prefetchBlocks[slot] = -1;
+
+    prefetchBuffer = (uint8 *) dma_alloc(CACHE_PREFETCH_SLOTS * BLOCK_SIZE);
+
+    for(int16 i = 0; i < blockCount; i++)
+    {
+        blocks[i].valid = 0;
+        blocks[i].dirty = 0;
+        blocks[i].busy = 0;
+        blocks[i].prefetched = 0;
+        blocks[i].prefetch = -1;
+        blocks[i].hashNext = -1;
+        cache_push_back(i);
+    }
+
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.evictions = 0;
+    stats.writebacks = 0;
+    stats.readaheads = 0;
+    stats.readaheadHits = 0;
+}
+
+int cache_read(int drive, uint32 lba, void *address, uint16 count)
+{
+    uint8 *dest = (uint8 *) address;
+    uint16 i = 0;
+
+    cache_reap();
+
+    while(i < count)
+    {
+        int16 block = cache_find(drive, lba + i);
+
+        if(block >= 0)
+        {
+            stats.hits++;
+            if(blocks[block].prefetched)
+            {
+                stats.readaheadHits++;
+                blocks[block].prefetched = 0;
+            }
+            memcpy(dest + i * BLOCK_SIZE, cache_buffer(block), BLOCK_SIZE);
+            cache_touch(block);
+            i++;
+            continue;
+        }
+
+        // Read the whole run of missing sectors straight into the caller's memory with one transfer
+        uint16 run = 1;
+        while(i + run < count && cache_lookup(drive, lba + i + run) < 0)
+            run++;
+
+        int result = blockdev_read(drive, lba + i, dest + i * BLOCK_SIZE, run);
+        if(result < 0)
+            return result;
+
+        stats.misses += run;
+
+        // The read may have slept, if someone cached one of these sectors meanwhile
+        // that copy is at least as new as the drive, so it wins
+        for(uint16 j = 0; j < run; j++)
+        {
+            int fresh;
+            block = cache_get(drive, lba + i + j, &fresh, 0);
+            if(block < 0)
+                continue;
+
+            if(fresh)
+                memcpy(cache_buffer(block), dest + (i + j) * BLOCK_SIZE, BLOCK_SIZE);
+            else
+                memcpy(dest + (i + j) * BLOCK_SIZE, cache_buffer(block), BLOCK_SIZE);
+        }
+
+        i += run;
+    }
+
+    return 0;
+}
+
+// Write-through: the drive is updated first, then the cached copies
+// Write-back: the cached copies are updated and marked dirty, the drive is left alone
+int cache_write(int drive, uint32 lba, void *address, uint16 count)
+{
+    uint8 *src = (uint8 *) address;
+    int result = 0;
+
+    cache_reap();
+
+    if(!writeBack)
+        result = blockdev_write(drive, lba, address, count);
+
+    for(uint16 i = 0; i < count; i++)
+    {
+        if(result < 0)
+        {
+            // Whatever is on the disk now is unknown, so forget these sectors
+            int16 block = cache_find_idle(drive, lba + i);
+            if(block >= 0)
+                cache_drop(block);
+            continue;
+        }
+
+        // Never copy into a block a sync is writing out, cache_get() waits for it to finish
+        int fresh;
+        int16 block = cache_get(drive, lba + i, &fresh, 0);
+
+        if(block < 0)
+        {
+            // No buffer could be freed, so this sector has to go to the drive right away
+            result = blockdev_write(drive, lba + i, src + i * BLOCK_SIZE, 1);
+            continue;
+        }
+
+        memcpy(cache_buffer(block), src + i * BLOCK_SIZE, BLOCK_SIZE);
+        blocks[block].dirty = writeBack;
+    }
+
+    return result;
+}
+
+void cache_invalidate(int drive)
+{
+    for(int slot = 0; slot < CACHE_PREFETCH_SLOTS; slot++)
+    {
+        if(prefetchBlocks[slot] >= 0)
+            cache_finish_prefetch(slot);
+    }
+
+    for(int16 i = 0; i < blockCount; i++)
+    {
+        if(blocks[i].valid && blocks[i].drive == drive)
+            cache_drop(i);
+    }
+}
+
+// Read-ahead for devices that finish every transfer before returning
+// Each run of uncached sectors is read with one command and then spread over cache blocks
+static int cache_prefetch_now(int drive, uint32 lba, uint16 count)
+{
+    int started = 0;
+    uint16 i = 0;
+
+    if(count > CACHE_PREFETCH_SLOTS)
+        count = CACHE_PREFETCH_SLOTS;
+
+    while(i < count)
+    {
+        if(cache_lookup(drive, lba + i) >= 0)
+        {
+            i++;
+            continue;
+        }
+
+        uint16 run = 1;
+        while(i + run < count && cache_lookup(drive, lba + i + run) < 0)
+            run++;
+
+        if(blockdev_read(drive, lba + i, prefetchBuffer, run) < 0)
+            break;
+
+        for(uint16 j = 0; j < run; j++)
+        {
+            int fresh;
+            int16 block = cache_get(drive, lba + i + j, &fresh, 0);
+            if(block < 0)
+                break;
+            if(!fresh)
+                continue;
+
+            memcpy(cache_buffer(block), prefetchBuffer + j * BLOCK_SIZE, BLOCK_SIZE);
+            blocks[block].prefetched = 1;
+            started++;
+        }
+
+        i += run;
+    }
+
+    stats.readaheads += started;
+    return started;
+}
+
+// Start reading the sectors of [lba, lba + count) that are not cached yet without waiting for them
+// The requests are queued together, so the floppy scheduler merges neighbouring sectors into one command
+int cache_prefetch(int drive, uint32 lba, uint16 count)
+{
+    int started = 0;
+    int slot = 0;
+
+    blockdev_t *device = blockdev_get(drive);
+    if(!device)
+        return 0;
+    if(!device->submit)
+        return cache_prefetch_now(drive, lba, count);
+
+    cache_reap();
+    blockdev_plug(drive);
+
+    for(uint16 i = 0; i < count; i++)
+    {
+        if(cache_lookup(drive, lba + i) >= 0)
+            continue;
+
+        while(slot < CACHE_PREFETCH_SLOTS && prefetchBlocks[slot] >= 0)
+            slot++;
+        if(slot == CACHE_PREFETCH_SLOTS)
+            break;
+
+        // The device is plugged, so writing a dirty block back here would never finish
+        // Read-ahead stops once only dirty blocks are left to reuse
+        int fresh;
+        int16 block = cache_get(drive, lba + i, &fresh, 1);
+        if(block < 0)
+            break;
+        if(!fresh)
+            continue;
+
+        blocks[block].busy = 1;
+        blocks[block].prefetched = 1;
+        blocks[block].prefetch = slot;
+        prefetchBlocks[slot] = block;
+
+        block_request_t *request = &prefetchRequests[slot];
+        request->type = BLOCK_REQUEST_READ;
+        request->lba = lba + i;
+        request->address = cache_buffer(block);
+        request->count = 1;
+        blockdev_submit(drive, request);
+
+        started++;
+    }
+
+    blockdev_unplug(drive);
+
+    stats.readaheads += started;
+    return started;
+}
+
+void cache_get_stats(cache_stats_t *result)
+{
+    *result = stats;
+}
+
+void cache_set_write_back(int enabled)
+{
+    if(!enabled)
+        cache_sync();
+
+    writeBack = enabled;
+}
+
+int cache_sync()
+{
+    // One sync at a time, anyone else waits for the running one to finish
+    while(syncing)
+        yield();
+    syncing = 1;
+
+    int16 dirty[CACHE_MAX_BLOCKS];
+    int dirtyCount = 0;
+
+    // Collect the dirty blocks sorted by (drive, lba) with an insertion sort,
+    // which is already the best order when the floppy scheduler runs FIFO
+    for(int16 i = 0; i < blockCount; i++)
+    {
+        // A busy dirty block is being written back on eviction already
+        if(!blocks[i].valid || !blocks[i].dirty || blocks[i].busy)
+            continue;
+
+        int j = dirtyCount;
+        while(j > 0 && (blocks[dirty[j - 1]].drive > blocks[i].drive ||
+              (blocks[dirty[j - 1]].drive == blocks[i].drive && blocks[dirty[j - 1]].lba > blocks[i].lba)))
+        {
+            dirty[j] = dirty[j - 1];
+            j--;
+        }
+        dirty[j] = i;
+        dirtyCount++;
+    }
+
+    // Queue every write before the devices start on any of them
+    for(int device = 0; device < blockdev_count(); device++)
+        blockdev_plug(device);
+
+    for(int i = 0; i < dirtyCount; i++)
+    {
+        cache_block_t *block = &blocks[dirty[i]];
+        block_request_t *request = &syncRequests[i];
+
+        request->type = BLOCK_REQUEST_WRITE;
+        request->lba = block->lba;
+        request->address = cache_buffer(dirty[i]);
+        request->count = 1;
+
+        // Writes that land while this one is in flight make the block dirty again
+        block->dirty = 0;
+        block->busy = 1;
+        blockdev_submit(block->drive, request);
+    }
+
+    for(int device = 0; device < blockdev_count(); device++)
+        blockdev_unplug(device);
+
+    int result = 0;
+
+    for(int i = 0; i < dirtyCount; i++)
+    {
+        int written = blockdev_wait(blocks[dirty[i]].drive, &syncRequests[i]);
+        blocks[dirty[i]].busy = 0;
+
+        if(written < 0)
+        {
+            blocks[dirty[i]].dirty = 1;
+            result = written;
+        }
+        else
+        {
+            stats.writebacks++;
+        }
+    }
+
+    if(dirtyCount > 0)
+    {
+        for(int device = 0; device < blockdev_count(); device++)
+        {
+            int flushed = blockdev_flush(device);
+            if(flushed < 0)
+                result = flushed;
+        }
+    }
+
+    syncing = 0;
+
+    return result;
+}
+
+void cache_flusher()
+{
+    int passes = 0;
+
+    while(writeBack)
+    {
+        passes++;
+        if(passes >= CACHE_FLUSH_INTERVAL)
+        {
+            cache_sync();
+            passes = 0;
+        }
+
+        yield();
+    }
+
+    exit();
+}
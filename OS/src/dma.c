@@ -1,5 +1,6 @@
 #include "./types.h"
 #include "./io.h"
+#include "./dma.h"
 
 #define low_16(address) (uint16)((address) & 0xFFFF)
 #define high_16(address) (uint16)(((address) >> 16) & 0xFFFF)
@@ -137,4 +138,62 @@ void prepare_for_floppyDMA_read(){
     // outb(ISA_DMA_REGISTER_SingleChannelMask, 0x02);
     maskChannel(2, 0);
 
+}
+
+
+/*
+ * DMA buffer pool
+ *
+ * ISA DMA only sees the low 16MB of memory and cannot cross a 64KB boundary in one transfer.
+ * The pool is one whole 64KB page in low memory handed out in 512 byte blocks, so every
+ * buffer it hands out is safe for any transfer that fits in it.
+ */
+
+static uint8 poolUsed[DMA_POOL_BLOCKS];    // Non-zero for blocks handed out
+
+void dma_pool_init(){
+    for(int i = 0; i < DMA_POOL_BLOCKS; i++)
+        poolUsed[i] = 0;
+}
+
+// First fit, returns 0 if there is no run of free blocks big enough
+void *dma_alloc(uint32 bytes){
+    int needed = (bytes + DMA_POOL_BLOCK_SIZE - 1) / DMA_POOL_BLOCK_SIZE;
+    int run = 0;
+
+    for(int i = 0; i < DMA_POOL_BLOCKS; i++){
+        run = poolUsed[i] ? 0 : run + 1;
+
+        if(run == needed){
+            int first = i - needed + 1;
+            for(int j = first; j <= i; j++)
+                poolUsed[j] = 1;
+            return (void *)(DMA_POOL_ADDRESS + first * DMA_POOL_BLOCK_SIZE);
+        }
+    }
+
+    return 0;
+}
+
+void dma_free(void *buffer, uint32 bytes){
+    int first = ((uint32) buffer - DMA_POOL_ADDRESS) / DMA_POOL_BLOCK_SIZE;
+    int count = (bytes + DMA_POOL_BLOCK_SIZE - 1) / DMA_POOL_BLOCK_SIZE;
+
+    for(int i = first; i < first + count && i < DMA_POOL_BLOCKS; i++)
+        poolUsed[i] = 0;
+}
+
+// How many of the first bytes at address ISA DMA can reach in one transfer
+// 0 if the address is above 16MB, otherwise everything up to the next 64KB boundary
+uint32 dma_safe_length(void *address, uint32 bytes){
+    uint32 start = (uint32) address;
+
+    if(start >= DMA_ISA_LIMIT)
+        return 0;
+
+    uint32 toBoundary = 0x10000 - (start & 0xFFFF);
+    if(start + toBoundary > DMA_ISA_LIMIT)
+        toBoundary = DMA_ISA_LIMIT - start;
+
+    return bytes < toBoundary ? bytes : toBoundary;
 }
\ No newline at end of file
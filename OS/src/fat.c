@@ -1,8 +1,10 @@
 #include "./fat.h"
-#include "./fdc.h"
+#include "./blockdev.h"
+#include "./cache.h"
 #include <stddef.h>
 #include "./string.h"
 #include "./io.h"
+#include "./multitasking.h"
 
 // FAT Copies
 // First copy is fat0 stored at 
@@ -13,416 +15,3712 @@ fat_t *fat0;
 fat_t *fat1;
 void *startAddress = (void *) 0x20000;
 
-// Initialize the file system
+// Lazy mounting
+// Nothing of the FATs or the root directory is read when the file system is mounted, a FAT sector
+// is read the first time an entry in it is used and root directory sectors are read in order as
+// lookups need them
+// fat1 is only read when verifyFAT() or checkFilesystem() compare it with fat0
+uint16 fatLoaded[2];    // One bit per sector of fat0 and fat1 that is in memory
+
+// Block device the file system lives on (see blockdev.h)
+int fsDevice;
+
+// Read-ahead for cluster chains
+// The window is how many clusters further down the chain get prefetched when a cluster is read
+// It doubles every time the chain is followed in order and halves when a read jumps somewhere else
+#define READAHEAD_MIN_WINDOW 1
+#define READAHEAD_MAX_WINDOW 16
+uint16 readaheadNext;   // The cluster that comes next if the chain is being followed
+readahead_stats_t readaheadStats;
+
+// Free-cluster bitmap
+// One bit per FAT entry, set while the cluster is in use, so free clusters are searched for 32 at a time
+// The search starts at the word the last allocation came from and wraps around (next fit)
+// Everything that frees or takes a cluster must go through freeCluster/allocateCluster/claimCluster
+#define FREE_MAP_WORDS ((FAT_ENTRIES + 31) / 32)
+uint32 freeMap[FREE_MAP_WORDS];
+uint16 freeMapHint;     // Word the next search starts at
+uint16 freeClusters;    // Clear bits in freeMap
+int freeMapReady;       // The map is built from the whole FAT, so only once something allocates
+
+// FAT dirty tracking
+// fat0 is the working copy, every change to it goes through setFatEntry() which marks the sectors
+// holding the entry dirty, syncFAT() then copies just the dirty sectors to fat1 and logs them for
+// both FATs
+// verifyFAT() only compares the sectors changed since it last ran
+uint16 fatDirty;        // One bit per FAT sector not yet mirrored and written
+uint16 fatUnverified;   // One bit per FAT sector changed since the last verifyFAT()
+
+// Metadata intent log
+// FAT and directory sectors aren't written to where they belong straight away, they collect in
+// memory and a group of them is committed to the last track of the disk with one sequential write,
+// only then are they written to their home sectors through the cache
+// A crash before a commit loses the whole group, one after it is put right at mount by writing the
+// group out again, so the FATs and the directories always change together
+// A FAT sector is logged once and goes to both copies
+// The log is only used on a disk whose FAT marks the track's clusters bad (fat.asm does), so no file
+// can be there, on any other disk the sectors are written straight to where they belong
+#define LOG_LBA 2862
+#define LOG_SECTORS 18
+#define LOG_MAX_SECTORS (LOG_SECTORS - 1)  // The header takes the first sector
+#define LOG_FIRST_CLUSTER (LOG_LBA - 33 + 2)
+#define LOG_MAGIC 0x474F4C46               // "FLOG"
+#define LOG_BUFFER_ADDRESS 0x24000         // Between the root directory and the file buffer pool
+#define LOG_GROUP_OPERATIONS 8             // Operations collected before a commit
+
+typedef struct
+{
+    uint32 magic;
+    uint32 checksum;            // Over lba[] and the sector images
+    uint16 count;               // Sector images after the header, 0 if there is nothing to replay
+    uint32 lba[LOG_MAX_SECTORS];    // Home sector of each image
+} __attribute__((packed)) log_header_t;
+
+// The header and the images are laid out in memory like on the disk, so a commit is one write
+log_header_t *logHeader = (log_header_t *) LOG_BUFFER_ADDRESS;
+#define logImage(i) ((uint8 *) LOG_BUFFER_ADDRESS + 512 * ((i) + 1))
+uint16 logOperations;   // Operations in the log since the last commit
+int logEnabled;         // Set at mount if the log track is reserved
+
+// Directory index
+// A directory's slots are found through a hash of the 8.3 name, so looking up, creating, renaming
+// and deleting an entry never scans the directory
+// A slot is free if the first byte of its name is 0x00 (never used) or 0xE5 (deleted), free slots
+// are kept on a list that starts out lowest slot first
+// Sectors are read and indexed one at a time as lookups miss, nothing past a slot that was never
+// used is in use either, so once one is seen a miss is final
+#define ROOT_ENTRIES 224
+#define DIR_HASH_BUCKETS 64
+#define DIR_ENTRIES_PER_SECTOR (512 / sizeof(directory_entry_t))
+#define ROOT_SECTORS 14
+
+typedef struct
+{
+    directory_entry_t *entries;     // First slot of the indexed directory in memory
+    uint32 lba;                     // Sector holding the first slot on the disk
+    uint16 slotCount;
+    uint16 loadedSlots;             // Slots read and indexed so far, always whole sectors
+    int ended;                      // A never used slot was read, the rest are free
+    int16 buckets[DIR_HASH_BUCKETS];
+    int16 next[ROOT_ENTRIES];       // Next slot in the same bucket, or on the free list
+    int16 freeHead;
+    int16 freeTail;
+} dir_index_t;
+
+dir_index_t rootIndex;
+
+// Where a directory entry is on the disk
+typedef struct
+{
+    uint32 lba;         // 0 if the entry wasn't found
+    uint16 offset;      // Byte offset of the entry in the sector
+} dir_slot_t;
+
+// Dentry cache
+// Lookups in subdirectories go through a cache of (directory, name) -> entry, so a name that was
+// looked up before costs no directory reads at all
+// Names that were looked for and aren't there are cached too (negative dentries)
+// The root directory is always in memory with its own index, so it is never cached here
+#define DENTRY_CACHE_SIZE 64
+#define DENTRY_BUCKETS 32
+
+typedef struct
+{
+    uint16 parent;              // First cluster of the directory the name is in, 0 if the dentry is unused
+    uint8 name[11];             // 8.3 name, padded like in a directory entry
+    uint8 negative;             // Set if the name is known not to be in the directory
+    int16 next;                 // Next dentry in the same bucket
+    dir_slot_t where;
+    directory_entry_t entry;
+} dentry_t;
+
+dentry_t dentries[DENTRY_CACHE_SIZE];
+int16 dentryBuckets[DENTRY_BUCKETS];
+int16 dentryHand;               // Next dentry to be replaced, round robin
+
+// The root directory as init_fs() set it up, paths are resolved from here
+directory_t rootDirectory;
+
+// File buffer pool
+// Whole-file buffers for openFile() and descriptor windows come out of the 128KB between 0x30000
+// and the cache buffers at 0x50000, handed out first fit in 512 byte blocks
+#define FILE_POOL_ADDRESS 0x30000
+#define FILE_POOL_BLOCK_SIZE 512
+#define FILE_POOL_BLOCKS (0x20000 / FILE_POOL_BLOCK_SIZE)
+uint8 filePoolUsed[FILE_POOL_BLOCKS];  // Non-zero for blocks handed out
+
+// Open-file table
+// A file that is open, through openFile() or open(), has one entry here however many times and
+// by however many processes it was opened, so they all share one size, one extent map and one
+// copy of the data, and the file is only read in by the first of them
+// The entry goes away when the last of them closes it
+typedef struct
+{
+    uint16 refCount;            // 0 if the entry is free
+    int loading;                // Set while the first openFile() is still reading the file in
+    dir_slot_t where;           // Where the file's directory entry is, lba 0 if it wasn't found
+    file_t file;                // startingAddress is the whole-file buffer, NULL until openFile() loads it
+    uint32 bufferSize;
+    uint32 bufferDirty[FILE_POOL_BLOCKS / 32];  // One bit per buffer sector written since it was last written out
+    uint32 storedSize;          // Size on the disk of a compressed file, file.entry has the real size
+    int sizeChanged;            // The directory entry needs the new size
+    uint16 preallocated;        // Clusters preallocateFile() asked for, kept until the last close
+    uint8 *window;              // Descriptor window, NULL until a descriptor reads or writes
+    uint32 windowOffset;        // File offset of the first sector in the window
+    uint16 windowSectors;       // Sectors loaded into the window, 0 if it is empty
+    uint16 windowDirty;         // One bit per window sector written since it was loaded
+} open_file_t;
+
+open_file_t openFiles[OPEN_FILE_MAX];
+
+// File descriptors
+// A file opened with open() is never loaded as a whole, read()/write() go through a window of a
+// few sectors in its open-file entry, each descriptor only has its own position
+typedef struct
+{
+    int inUse;
+    int16 openFile;             // Entry in openFiles
+    uint32 position;
+} fd_t;
+
+fd_t fds[FD_MAX];
+
+// Entries of the directory tree the defragmenter has gone past (see defragment())
+uint16 defragCursor;
+
+// FAT12 codec
+// Entries are 12 bits, two of them packed into three bytes, little endian:
+// entry 2n is byte 3n plus the low nibble of byte 3n+1, entry 2n+1 is the high nibble of byte 3n+1
+// plus byte 3n+2
+// An entry can straddle two sectors, and everything above 0xFF8 marks the end of a chain
+// The rest of the file system sees the end of a chain as 0xFFFF, the codec translates both ways
+
+// Make sure the sectors of a FAT holding bytes first to last are in memory
+// Missing sectors next to each other are read with one transfer
+// Returns -1 if one of them couldn't be read, it stays not loaded and is tried again next time
+int fatLoad(fat_t *fat, uint16 first, uint16 last)
+{
+    int copy = fat == fat1;
+    int result = 0;
+    uint16 sector = first / 512;
+    uint16 end = last / 512 < FAT_SECTORS ? last / 512 : FAT_SECTORS - 1;
+
+    while (sector <= end)
+    {
+        if (fatLoaded[copy] & (1 << sector))
+        {
+            sector++;
+            continue;
+        }
+
+        uint16 run = 1;
+        while (sector + run <= end && !(fatLoaded[copy] & (1 << (sector + run))))
+            run++;
+
+        if (cache_read(fsDevice, (copy ? 10 : 1) + sector, (void *)&fat->bytes[sector * 512], run) == 0)
+            fatLoaded[copy] |= ((1 << run) - 1) << sector;
+        else
+            result = -1;
+        sector += run;
+    }
+
+    return result;
+}
+
+// An entry whose sector can't be read reads as bad, so no walk follows it and it is never handed out
+uint16 fat12Get(fat_t *fat, uint16 cluster)
+{
+    uint16 offset = cluster + cluster / 2;
+    if (fatLoad(fat, offset, offset + 1) < 0)
+        return FAT12_BAD;
+
+    uint16 value = fat->bytes[offset] | (fat->bytes[offset + 1] << 8);
+
+    value = cluster & 1 ? value >> 4 : value & 0x0FFF;
+
+    return value >= FAT12_EOF_MIN ? FAT_EOF : value;
+}
+
+// Returns -1, and changes nothing, if the entry's sector can't be read
+int fat12Put(fat_t *fat, uint16 cluster, uint16 value)
+{
+    uint16 offset = cluster + cluster / 2;
+    if (fatLoad(fat, offset, offset + 1) < 0)
+        return -1;
+
+    value = value == FAT_EOF ? 0x0FFF : value & 0x0FFF;
+
+    if (cluster & 1)
+    {
+        fat->bytes[offset] = (fat->bytes[offset] & 0x0F) | (value << 4);
+        fat->bytes[offset + 1] = value >> 4;
+    }
+    else
+    {
+        fat->bytes[offset] = value;
+        fat->bytes[offset + 1] = (fat->bytes[offset + 1] & 0xF0) | (value >> 8);
+    }
+
+    return 0;
+}
+
+// Expand count entries starting at first into entries[] in one pass, three bytes at a time
+void fat12Decode(fat_t *fat, uint16 first, uint16 count, uint16 *entries)
+{
+    uint16 i = 0;
+
+    if (count == 0)
+        return;
+
+    // Entry by entry if a sector is missing, fat12Get() reads those as bad
+    if (fatLoad(fat, first + first / 2, (first + count - 1) + (first + count - 1) / 2 + 1) < 0)
+    {
+        for (; i < count; i++)
+            entries[i] = fat12Get(fat, first + i);
+        return;
+    }
+
+    // Line up on a pair
+    if (first & 1 && count > 0)
+    {
+        entries[i++] = fat12Get(fat, first);
+    }
+
+    uint8 *bytes = &fat->bytes[(first + i) + (first + i) / 2];
+    for (; i + 1 < count; i += 2, bytes += 3)
+    {
+        uint16 even = bytes[0] | ((bytes[1] & 0x0F) << 8);
+        uint16 odd = (bytes[1] >> 4) | (bytes[2] << 4);
+
+        entries[i] = even >= FAT12_EOF_MIN ? FAT_EOF : even;
+        entries[i + 1] = odd >= FAT12_EOF_MIN ? FAT_EOF : odd;
+    }
+
+    if (i < count)
+    {
+        entries[i] = fat12Get(fat, first + i);
+    }
+}
+
+// The entries that have at least one byte in a FAT sector
+// Returns the first one and sets count
+uint16 fat12SectorEntries(uint16 sector, uint16 *count)
+{
+    uint16 first = (sector * 512 * 2) / 3;
+    uint16 end = ((sector + 1) * 512 * 2 + 2) / 3;
+
+    if (end > FAT12_TABLE_ENTRIES)
+        end = FAT12_TABLE_ENTRIES;
+
+    *count = end - first;
+    return first;
+}
+
+uint16 getFatEntry(uint16 cluster)
+{
+    return fat12Get(fat0, cluster);
+}
+
+void setFatEntry(uint16 cluster, uint16 value)
+{
+    uint16 offset = cluster + cluster / 2;
+    uint16 bits = (1 << (offset / 512)) | (1 << ((offset + 1) / 512));
+
+    // Nothing changed in memory, so there is nothing to write back
+    if (fat12Put(fat0, cluster, value) < 0)
+        return;
+    fatDirty |= bits;
+    fatUnverified |= bits;
+}
+
+uint32 logChecksum()
+{
+    uint32 sum = 0;
+
+    for (uint16 i = 0; i < logHeader->count; i++)
+    {
+        uint32 *words = (uint32 *) logImage(i);
+
+        sum = ((sum << 1) | (sum >> 31)) + logHeader->lba[i];
+        for (uint16 w = 0; w < 512 / 4; w++)
+            sum = ((sum << 1) | (sum >> 31)) + words[w];
+    }
+
+    return sum;
+}
+
+// The image of a sector in the log, -1 if it isn't there
+int16 logFind(uint32 lba)
+{
+    for (int16 i = 0; i < logHeader->count; i++)
+    {
+        if (logHeader->lba[i] == lba)
+            return i;
+    }
+
+    return -1;
+}
+
+// Write a metadata sector to its home sector, and to the second FAT if it is a FAT sector
+void writeMetadata(uint32 lba, void *data)
+{
+    cache_write(fsDevice, lba, data, 1);
+    if (lba >= 1 && lba < 1 + FAT_SECTORS)
+        cache_write(fsDevice, lba + FAT_SECTORS, data, 1);
+}
+
+// Write image i to its home sector
+void logCheckpoint(uint16 i)
+{
+    writeMetadata(logHeader->lba[i], logImage(i));
+}
+
+// Commit the log with one write and hand its sectors to the cache to be written home
+void logCommit()
+{
+    if (logHeader->count == 0)
+        return;
+
+    // The last group has to be home before the log that covers it is overwritten
+    cache_sync();
+
+    logHeader->magic = LOG_MAGIC;
+    logHeader->checksum = logChecksum();
+    blockdev_write(fsDevice, LOG_LBA, logHeader, 1 + logHeader->count);
+    blockdev_flush(fsDevice);
+
+    for (uint16 i = 0; i < logHeader->count; i++)
+        logCheckpoint(i);
+
+    logHeader->count = 0;
+    logOperations = 0;
+}
+
+// Add a metadata sector to the log, a sector already in it is replaced
+// Without a log it is written home right away
+void logSector(uint32 lba, void *data)
+{
+    if (!logEnabled)
+    {
+        writeMetadata(lba, data);
+        return;
+    }
+
+    int16 i = logFind(lba);
+    if (i < 0)
+    {
+        if (logHeader->count == LOG_MAX_SECTORS)
+            logCommit();
+
+        i = logHeader->count++;
+        logHeader->lba[i] = lba;
+    }
+
+    memcpy(logImage(i), data, 512);
+}
+
+// An operation's sectors are all in the log, commit once enough operations have collected
+void logEnd()
+{
+    if (++logOperations >= LOG_GROUP_OPERATIONS)
+        logCommit();
+}
+
+// Read a metadata sector as it is now, the log has it if it changed since the last commit
+void readMetadata(uint32 lba, void *buffer)
+{
+    int16 i = logFind(lba);
+
+    if (i >= 0)
+        memcpy(buffer, logImage(i), 512);
+    else
+        cache_read(fsDevice, lba, buffer, 1);
+}
+
+// Mark the log as having nothing to replay
+void logClear()
+{
+    if (!logEnabled)
+        return;
+
+    logHeader->magic = LOG_MAGIC;
+    logHeader->count = 0;
+    blockdev_write(fsDevice, LOG_LBA, logHeader, 1);
+
+    logOperations = 0;
+}
+
+// Replay the last committed group at mount, the system may have stopped before it was all home
+// A clean unmount leaves nothing to replay, so this costs one read
+void logRecover()
+{
+    if (blockdev_read(fsDevice, LOG_LBA, logHeader, 1) < 0 || logHeader->magic != LOG_MAGIC ||
+        logHeader->count == 0 || logHeader->count > LOG_MAX_SECTORS)
+    {
+        logHeader->count = 0;
+        logOperations = 0;
+        return;
+    }
+
+    // A group that didn't finish being committed fails the checksum and is dropped
+    if (blockdev_read(fsDevice, LOG_LBA + 1, logImage(0), logHeader->count) == 0 &&
+        logChecksum() == logHeader->checksum)
+    {
+        for (uint16 i = 0; i < logHeader->count; i++)
+            logCheckpoint(i);
+        cache_sync();
+    }
+
+    logClear();
+}
+
+// Use the log only if the FAT marks every cluster of its track bad, and replay it if so
+// The FAT sectors read for the check are read again afterwards, the replay may have changed them
+void logMount()
+{
+    logHeader->count = 0;
+    logOperations = 0;
+
+    logEnabled = 1;
+    for (uint16 cluster = LOG_FIRST_CLUSTER; cluster < LOG_FIRST_CLUSTER + LOG_SECTORS; cluster++)
+    {
+        if (fat12Get(fat0, cluster) != FAT12_BAD)
+            logEnabled = 0;
+    }
+
+    if (logEnabled)
+        logRecover();
+
+    fatLoaded[0] = 0;
+    fatLoaded[1] = 0;
+}
+
+// Mirror the dirty sectors of fat0 into fat1 and log them for both FATs on the disk
+void syncFAT()
+{
+    for (uint16 sector = 0; sector < FAT_SECTORS; sector++)
+    {
+        if (!(fatDirty & (1 << sector)))
+            continue;
+
+        memcpy(&fat1->bytes[sector * 512], &fat0->bytes[sector * 512], 512);
+        fatLoaded[1] |= 1 << sector;    // Overwritten whole, no need to read it
+
+        logSector(1 + sector, &fat0->bytes[sector * 512]);
+    }
+
+    fatDirty = 0;
+}
+
+// Set or clear the bit of a cluster and keep the free count in step
+// Before the map is built the FAT is all there is, the map picks the change up when it is built
+void markCluster(uint16 cluster, int used)
+{
+    if (!freeMapReady)
+        return;
+
+    uint32 bit = 1 << (cluster % 32);
+    uint32 *word = &freeMap[cluster / 32];
+
+    if (used && !(*word & bit))
+    {
+        *word |= bit;
+        freeClusters--;
+    }
+    else if (!used && (*word & bit))
+    {
+        *word &= ~bit;
+        freeClusters++;
+    }
+}
+
+// Rebuild the bitmap from fat0, clusters 0 and 1 are reserved and never handed out
+void buildFreeMap()
+{
+    freeMapReady = 1;
+    freeMapHint = 0;
+
+    for (uint16 i = 0; i < FREE_MAP_WORDS; i++)
+        freeMap[i] = 0;
+
+    // Decoded a chunk at a time
+    uint16 entries[256];
+
+    freeClusters = FAT_ENTRIES;
+    for (uint16 first = 0; first < FAT_ENTRIES; first += 256)
+    {
+        uint16 count = FAT_ENTRIES - first < 256 ? FAT_ENTRIES - first : 256;
+        fat12Decode(fat0, first, count, entries);
+
+        for (uint16 i = 0; i < count; i++)
+        {
+            if (first + i < 2 || entries[i] != 0x0000)
+                markCluster(first + i, 1);
+        }
+    }
+
+    // The last word runs past the end of the FAT, its spare bits must never look free
+    for (uint16 cluster = FAT_ENTRIES; cluster < FREE_MAP_WORDS * 32; cluster++)
+        freeMap[cluster / 32] |= 1 << (cluster % 32);
+}
+
+// Build the bitmap the first time it is needed
+void needFreeMap()
+{
+    if (!freeMapReady)
+        buildFreeMap();
+}
+
+// Take a free cluster and mark it as the end of a chain in fat0
+// Returns the cluster, or 0 if the disk is full
+uint16 allocateCluster()
+{
+    needFreeMap();
+
+    for (uint16 i = 0; i < FREE_MAP_WORDS; i++)
+    {
+        uint16 word = (freeMapHint + i) % FREE_MAP_WORDS;
+
+        if (freeMap[word] == 0xFFFFFFFF)
+            continue;
+
+        uint16 cluster = word * 32 + __builtin_ctz(~freeMap[word]);
+        markCluster(cluster, 1);
+        setFatEntry(cluster, 0xFFFF);
+        freeMapHint = word;
+
+        return cluster;
+    }
+
+    return 0;
+}
+
+// Take a specific cluster, returns -1 if it is already in use
+int claimCluster(uint16 cluster)
+{
+    if (cluster < 2 || cluster >= FAT_ENTRIES || getFatEntry(cluster) != 0x0000)
+        return -1;
+
+    markCluster(cluster, 1);
+    setFatEntry(cluster, 0xFFFF);
+
+    return 0;
+}
+
+// FNV-1a over the 11 name bytes
+uint16 hashName(uint8 *filename, uint8 *extension)
+{
+    uint32 hash = 2166136261;
+
+    for (int i = 0; i < 8; i++)
+        hash = (hash ^ filename[i]) * 16777619;
+    for (int i = 0; i < 3; i++)
+        hash = (hash ^ extension[i]) * 16777619;
+
+    return hash % DIR_HASH_BUCKETS;
+}
+
+int slotIsFree(directory_entry_t *entry)
+{
+    return entry->filename[0] == 0x00 || entry->filename[0] == 0xE5;
+}
+
+void indexInsert(dir_index_t *index, int16 slot)
+{
+    uint16 bucket = hashName(index->entries[slot].filename, index->entries[slot].extension);
+
+    index->next[slot] = index->buckets[bucket];
+    index->buckets[bucket] = slot;
+}
+
+void indexRemove(dir_index_t *index, int16 slot)
+{
+    int16 *link = &index->buckets[hashName(index->entries[slot].filename, index->entries[slot].extension)];
+
+    while (*link >= 0 && *link != slot)
+        link = &index->next[*link];
+
+    if (*link == slot)
+        *link = index->next[slot];
+}
+
+// Set up an index for a directory that is read in as lookups need it
+void buildDirectoryIndex(dir_index_t *index, directory_entry_t *entries, uint16 slotCount, uint32 lba)
+{
+    index->entries = entries;
+    index->lba = lba;
+    index->slotCount = slotCount;
+    index->loadedSlots = 0;
+    index->ended = 0;
+    index->freeHead = -1;
+    index->freeTail = -1;
+
+    for (int i = 0; i < DIR_HASH_BUCKETS; i++)
+        index->buckets[i] = -1;
+}
+
+// Read the next sector of a directory and index its slots
+// Free slots go on the end of the free list so it stays lowest slot first, which keeps every
+// slot in use ahead of the first never used one
+// Returns -1 if every sector is already in
+int loadDirectorySector(dir_index_t *index)
+{
+    if (index->loadedSlots >= index->slotCount)
+        return -1;
+
+    int16 first = index->loadedSlots;
+    cache_read(fsDevice, index->lba + first / DIR_ENTRIES_PER_SECTOR, (void *)&index->entries[first], 1);
+    index->loadedSlots += DIR_ENTRIES_PER_SECTOR;
+
+    for (int16 slot = first; slot < index->loadedSlots; slot++)
+    {
+        if (!slotIsFree(&index->entries[slot]))
+        {
+            indexInsert(index, slot);
+            continue;
+        }
+
+        if (index->entries[slot].filename[0] == 0x00)
+            index->ended = 1;
+
+        index->next[slot] = -1;
+        if (index->freeTail < 0)
+            index->freeHead = slot;
+        else
+            index->next[index->freeTail] = slot;
+        index->freeTail = slot;
+    }
+
+    return 0;
+}
+
+// Read sectors up to the end of the slots in use, for everything that walks the whole directory
+void loadDirectory(dir_index_t *index)
+{
+    while (!index->ended && loadDirectorySector(index) == 0)
+        ;
+}
+
+// The index of a directory, NULL if it has none
+dir_index_t *directoryIndex(directory_t *directory)
+{
+    if (directory->startingAddress == (uint8 *) rootIndex.entries)
+        return &rootIndex;
+
+    return NULL;
+}
+
+// The slot holding filename.ext, -1 if there is none
+int16 indexLookup(dir_index_t *index, char *filename, char *ext)
+{
+    uint16 bucket = hashName((uint8 *) filename, (uint8 *) ext);
+
+    do
+    {
+        int16 slot = index->buckets[bucket];
+
+        while (slot >= 0)
+        {
+            directory_entry_t *entry = &index->entries[slot];
+            if (stringcompare((char *)entry->filename, filename, 8) && stringcompare((char *)entry->extension, ext, 3))
+                return slot;
+
+            slot = index->next[slot];
+        }
+
+        // Not in what has been read so far, it can only be in the next sector
+    } while (!index->ended && loadDirectorySector(index) == 0);
+
+    return -1;
+}
+
+// Log the sector holding a slot to be written back to the disk
+void writeDirectorySlot(dir_index_t *index, int16 slot)
+{
+    uint16 sector = slot / (512 / sizeof(directory_entry_t));
+
+    logSector(index->lba + sector, (uint8 *) index->entries + sector * 512);
+}
+
+// Number of free clusters in a row starting at cluster, at most limit
+uint16 freeRunLength(uint16 cluster, uint16 limit)
+{
+    uint16 length = 0;
+
+    needFreeMap();
+
+    while (length < limit && cluster + length < FAT_ENTRIES &&
+           !(freeMap[(cluster + length) / 32] & (1 << ((cluster + length) % 32))))
+    {
+        length++;
+    }
+
+    return length;
+}
+
+// Take the free clusters [start, start + length) and chain them in order, the last one is EOF
+void takeRun(uint16 start, uint16 length)
+{
+    for (uint16 i = 0; i < length; i++)
+    {
+        markCluster(start + i, 1);
+        setFatEntry(start + i, i + 1 < length ? start + i + 1 : 0xFFFF);
+    }
+
+    freeMapHint = ((start + length) / 32) % FREE_MAP_WORDS;
+}
+
+// Take up to count contiguous clusters as one chain
+// The first run of count free clusters from the next-fit hint on is used, if there is none
+// the longest run on the disk is used instead and the caller has to come back for the rest
+// Returns the first cluster (0 if the disk is full) and how many clusters were taken in length
+uint16 allocateRun(uint16 count, uint16 *length)
+{
+    uint16 bestStart = 0;
+    uint16 bestLength = 0;
+    uint16 start = freeMapHint * 32;
+    uint16 scanned = 0;
+
+    needFreeMap();
+    while (scanned < FAT_ENTRIES && bestLength < count)
+    {
+        uint16 cluster = (start + scanned) % FAT_ENTRIES;
+
+        // Skip whole words of used clusters
+        if (cluster % 32 == 0 && freeMap[cluster / 32] == 0xFFFFFFFF)
+        {
+            scanned += 32;
+            continue;
+        }
+
+        uint16 run = freeRunLength(cluster, count);
+        if (run > bestLength)
+        {
+            bestStart = cluster;
+            bestLength = run;
+        }
+
+        scanned += run > 0 ? run : 1;
+    }
+
+    *length = bestLength;
+    if (bestLength == 0)
+        return 0;
+
+    takeRun(bestStart, bestLength);
+    return bestStart;
+}
+
+// Add count clusters to the chain ending at last
+// The clusters right after last are used when they are free, so a growing file stays in one piece
+// If file is not NULL the new clusters are added to its extent map
+// Returns -1 if the disk filled up before all of them were added, or last isn't a cluster
+// (a file with no clusters has no chain to extend)
+int extendChain(uint16 last, uint16 count, file_t *file)
+{
+    if (last < 2 || last >= FAT_ENTRIES)
+        return -1;
+
+    while (count > 0)
+    {
+        uint16 length = freeRunLength(last + 1, count);
+        uint16 start = last + 1;
+
+        if (length > 0)
+            takeRun(start, length);
+        else
+            start = allocateRun(count, &length);
+
+        if (length == 0)
+            return -1;
+
+        setFatEntry(last, start);
+        last = start + length - 1;
+        count -= length;
+
+        if (file != NULL)
+            appendExtent(file, start, length);
+    }
+
+    return 0;
+}
+
+// The shared copy of an open file, or the file itself if it isn't open
+file_t *sharedFile(file_t *file)
+{
+    return file->isOpened ? &openFiles[file->openFile].file : file;
+}
+
+// Make sure the file has clusters for size bytes without changing its size
+// Writers that know how big a file will get call this first so that its clusters are contiguous
+// The file must be open (or just created) so that its extent map is there
+// An open file keeps the clusters through flushes, the last closeFile() gives back what wasn't written
+int preallocateFile(file_t *file, uint32 size)
+{
+    file = sharedFile(file);
+    uint16 wanted = size > 0 ? (size + 511) / 512 : 1;
+    uint16 have = clusterCount(file);
+
+    if (file->isOpened && openFiles[file->openFile].preallocated < wanted)
+        openFiles[file->openFile].preallocated = wanted;
+
+    if (have >= wanted)
+        return 0;
+
+    return extendChain(fileCluster(file, have - 1), wanted - have, file);
+}
+
+// Extent maps
+// An open file keeps its chain as a short list of (offset in the file, first cluster, length) runs,
+// so finding the cluster behind an offset is a binary search instead of a walk down the FAT
+// A file in more pieces than FILE_MAX_EXTENTS only has its first pieces mapped,
+// offsets past them are found by following the FAT from the end of the last extent
+
+// Add the clusters [cluster, cluster + length) to the end of the file's extent map
+void appendExtent(file_t *file, uint16 cluster, uint16 length)
+{
+    // Once the map stops short of the chain, anything added later is found through the FAT
+    if (!file->extentsComplete)
+        return;
+
+    file_extent_t *last = file->extentCount > 0 ? &file->extents[file->extentCount - 1] : NULL;
+
+    if (last != NULL && last->cluster + last->length == cluster)
+    {
+        last->length += length;
+    }
+    else if (file->extentCount < FILE_MAX_EXTENTS)
+    {
+        file_extent_t *extent = &file->extents[file->extentCount++];
+        extent->offset = file->mappedClusters;
+        extent->cluster = cluster;
+        extent->length = length;
+    }
+    else
+    {
+        file->extentsComplete = 0;
+        return;
+    }
+
+    file->mappedClusters += length;
+}
+
+// Walk the file's chain once and record its runs
+void buildExtentMap(file_t *file)
+{
+    uint16 current = file->entry.startingCluster;
+
+    file->extentCount = 0;
+    file->mappedClusters = 0;
+    file->extentsComplete = 1;
+
+    // An empty file has cluster 0, and entry 0 is the media byte, not a link
+    while (current >= 2 && current < FAT_ENTRIES && file->extentsComplete)
+    {
+        uint16 run = 1;
+        while (getFatEntry(current + run - 1) == current + run)
+            run++;
+
+        appendExtent(file, current, run);
+        current = getFatEntry(current + run - 1);
+    }
+}
+
+// The disk cluster holding cluster number index of the file (counting from 0), 0xFFFF past the end
+uint16 fileCluster(file_t *file, uint16 index)
+{
+    if (index < file->mappedClusters)
+    {
+        // Last extent that starts at or before index
+        uint16 low = 0;
+        uint16 high = file->extentCount - 1;
+        while (low < high)
+        {
+            uint16 middle = (low + high + 1) / 2;
+            if (file->extents[middle].offset <= index)
+                low = middle;
+            else
+                high = middle - 1;
+        }
+
+        file_extent_t *extent = &file->extents[low];
+        return extent->cluster + (index - extent->offset);
+    }
+
+    if (file->extentsComplete)
+        return 0xFFFF;
+
+    // Past the map, follow the FAT from the last mapped cluster
+    file_extent_t *last = &file->extents[file->extentCount - 1];
+    uint16 current = last->cluster + last->length - 1;
+    for (uint16 i = file->mappedClusters - 1; i < index && current >= 2 && current < FAT_ENTRIES; i++)
+        current = getFatEntry(current);
+
+    return current >= 2 && current < FAT_ENTRIES ? current : 0xFFFF;
+}
+
+// The LBA of the sector holding byte offset of the file, 0 if the file has no cluster there
+uint32 fileOffsetToLba(file_t *file, uint32 offset)
+{
+    uint16 cluster = fileCluster(file, offset / 512);
+
+    return cluster == 0xFFFF ? 0 : 33 + (cluster - 2);
+}
+
+void freeCluster(uint16 cluster)
+{
+    setFatEntry(cluster, 0x0000);
+    markCluster(cluster, 0);
+}
+
+uint16 getFreeClusterCount()
+{
+    needFreeMap();
+    return freeClusters;
+}
+
+// Subdirectories
+// A subdirectory is a cluster chain of 32 byte entries like the root directory, starting with
+// "." (itself) and ".." (its parent, cluster 0 for the root)
+// They aren't loaded into memory, their entries are read through the sector cache when a lookup
+// misses the dentry cache
+uint16 dentryHash(uint16 parent, char *filename, char *ext)
+{
+    return (hashName((uint8 *) filename, (uint8 *) ext) * 31 + parent) % DENTRY_BUCKETS;
+}
+
+void dentryInit()
+{
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++)
+        dentries[i].parent = 0;
+    for (int i = 0; i < DENTRY_BUCKETS; i++)
+        dentryBuckets[i] = -1;
+
+    dentryHand = 0;
+}
+
+dentry_t *dentryLookup(uint16 parent, char *filename, char *ext)
+{
+    int16 i = dentryBuckets[dentryHash(parent, filename, ext)];
+
+    while (i >= 0)
+    {
+        dentry_t *dentry = &dentries[i];
+        if (dentry->parent == parent && stringcompare((char *)dentry->name, filename, 8) &&
+            stringcompare((char *)dentry->name + 8, ext, 3))
+        {
+            return dentry;
+        }
+
+        i = dentry->next;
+    }
+
+    return NULL;
+}
+
+// Take a dentry out of its bucket and mark it unused
+void dentryDrop(int16 i)
+{
+    dentry_t *dentry = &dentries[i];
+    int16 *link = &dentryBuckets[dentryHash(dentry->parent, (char *)dentry->name, (char *)dentry->name + 8)];
+
+    while (*link >= 0 && *link != i)
+        link = &dentries[*link].next;
+
+    if (*link == i)
+        *link = dentry->next;
+
+    dentry->parent = 0;
+}
+
+// Remember what a lookup of filename.ext in the directory starting at parent found,
+// entry NULL means it isn't there
+void dentryStore(uint16 parent, char *filename, char *ext, directory_entry_t *entry, dir_slot_t *where)
+{
+    dentry_t *dentry = dentryLookup(parent, filename, ext);
+
+    if (dentry == NULL)
+    {
+        int16 i = dentryHand;
+        dentryHand = (dentryHand + 1) % DENTRY_CACHE_SIZE;
+
+        if (dentries[i].parent != 0)
+            dentryDrop(i);
+
+        dentry = &dentries[i];
+        dentry->parent = parent;
+        memcpy(dentry->name, filename, 8);
+        memcpy(dentry->name + 8, ext, 3);
+
+        uint16 bucket = dentryHash(parent, filename, ext);
+        dentry->next = dentryBuckets[bucket];
+        dentryBuckets[bucket] = i;
+    }
+
+    dentry->negative = entry == NULL;
+    if (entry != NULL)
+    {
+        dentry->entry = *entry;
+        dentry->where = *where;
+    }
+}
+
+// Keep cached copies of the entry at where the same as what was just written there
+void dentryRefresh(dir_slot_t *where, directory_entry_t *entry)
+{
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++)
+    {
+        dentry_t *dentry = &dentries[i];
+        if (dentry->parent != 0 && !dentry->negative && dentry->where.lba == where->lba &&
+            dentry->where.offset == where->offset)
+        {
+            dentry->entry = *entry;
+        }
+    }
+}
+
+// Forget every name in a directory
+void dentryForget(uint16 parent)
+{
+    for (int16 i = 0; i < DENTRY_CACHE_SIZE; i++)
+    {
+        if (dentries[i].parent == parent)
+            dentryDrop(i);
+    }
+}
+
+dir_slot_t rootSlot(int16 slot)
+{
+    dir_slot_t where;
+    where.lba = rootIndex.lba + slot / DIR_ENTRIES_PER_SECTOR;
+    where.offset = (slot % DIR_ENTRIES_PER_SECTOR) * sizeof(directory_entry_t);
+    return where;
+}
+
+// The root slot at where, -1 if where isn't in the root directory
+int16 rootSlotAt(dir_slot_t *where)
+{
+    if (where->lba < rootIndex.lba || where->lba >= rootIndex.lba + ROOT_SECTORS)
+        return -1;
+
+    return (where->lba - rootIndex.lba) * DIR_ENTRIES_PER_SECTOR + where->offset / sizeof(directory_entry_t);
+}
+
+// Read the entry at where as it is now
+void loadEntry(dir_slot_t *where, directory_entry_t *entry)
+{
+    int16 slot = rootSlotAt(where);
+    if (slot >= 0)
+    {
+        *entry = rootIndex.entries[slot];
+        return;
+    }
+
+    uint8 sector[512];
+    readMetadata(where->lba, sector);
+    memcpy(entry, sector + where->offset, sizeof(directory_entry_t));
+}
+
+// Write an entry back to where it is on the disk
+// This doesn't rename, a root entry's name must stay the same so the root index stays right
+void storeEntry(dir_slot_t *where, directory_entry_t *entry)
+{
+    int16 slot = rootSlotAt(where);
+    if (slot >= 0)
+    {
+        rootIndex.entries[slot] = *entry;
+        writeDirectorySlot(&rootIndex, slot);
+    }
+    else
+    {
+        uint8 sector[512];
+        readMetadata(where->lba, sector);
+        memcpy(sector + where->offset, entry, sizeof(directory_entry_t));
+        logSector(where->lba, sector);
+    }
+
+    dentryRefresh(where, entry);
+}
+
+// Go through a subdirectory's clusters looking for filename.ext (filename NULL looks for nothing)
+// Returns 1 and fills in entry and where if it is there
+// If freeSlot is not NULL it gets the first free slot (lba 0 if every slot is taken), and last
+// gets the directory's last cluster
+int scanDirectory(uint16 cluster, char *filename, char *ext, directory_entry_t *entry, dir_slot_t *where,
+                  dir_slot_t *freeSlot, uint16 *last)
+{
+    uint8 sector[512];
+    directory_entry_t *entries = (directory_entry_t *) sector;
+
+    if (freeSlot != NULL)
+        freeSlot->lba = 0;
+
+    while (cluster >= 2 && cluster < FAT_ENTRIES)
+    {
+        uint32 lba = 33 + (cluster - 2);
+        readMetadata(lba, sector);
+
+        if (last != NULL)
+            *last = cluster;
+
+        for (uint16 i = 0; i < DIR_ENTRIES_PER_SECTOR; i++)
+        {
+            if (slotIsFree(&entries[i]))
+            {
+                if (freeSlot != NULL && freeSlot->lba == 0)
+                {
+                    freeSlot->lba = lba;
+                    freeSlot->offset = i * sizeof(directory_entry_t);
+                }
+
+                // Nothing past an entry that was never used is in use either
+                if (entries[i].filename[0] == 0x00)
+                    return 0;
+
+                continue;
+            }
+
+            if (filename != NULL && stringcompare((char *)entries[i].filename, filename, 8) &&
+                stringcompare((char *)entries[i].extension, ext, 3))
+            {
+                *entry = entries[i];
+                where->lba = lba;
+                where->offset = i * sizeof(directory_entry_t);
+                return 1;
+            }
+        }
+
+        cluster = getFatEntry(cluster);
+    }
+
+    return 0;
+}
+
+// Look up filename.ext in a directory, through the root index or the dentry cache
+// Returns 1 and fills in entry and where if it is there
+int findEntry(directory_t *directory, char *filename, char *ext, directory_entry_t *entry, dir_slot_t *where)
+{
+    dir_index_t *index = directoryIndex(directory);
+    if (index != NULL)
+    {
+        int16 slot = indexLookup(index, filename, ext);
+        if (slot < 0)
+            return 0;
+
+        *entry = index->entries[slot];
+        *where = rootSlot(slot);
+        return 1;
+    }
+
+    uint16 cluster = directory->entry.startingCluster;
+    dentry_t *dentry = dentryLookup(cluster, filename, ext);
+    if (dentry != NULL)
+    {
+        if (dentry->negative)
+            return 0;
+
+        *entry = dentry->entry;
+        *where = dentry->where;
+        return 1;
+    }
+
+    int found = scanDirectory(cluster, filename, ext, entry, where, NULL, NULL);
+    dentryStore(cluster, filename, ext, found ? entry : NULL, where);
+
+    return found;
+}
+
+// Add an entry to a directory
+// A full subdirectory grows by a cluster, returns -1 if the root directory or the disk is full
+int insertEntry(directory_t *parent, directory_entry_t *entry, dir_slot_t *where)
+{
+    dir_index_t *index = directoryIndex(parent);
+    if (index != NULL)
+    {
+        // Take the first free slot rather than overwriting whatever is in the first one
+        while (index->freeHead < 0 && loadDirectorySector(index) == 0)
+            ;
+
+        int16 slot = index->freeHead;
+        if (slot < 0)
+            return -1; // Directory full
+
+        index->freeHead = index->next[slot];
+        if (index->freeHead < 0)
+            index->freeTail = -1;
+        index->entries[slot] = *entry;
+
+        indexInsert(index, slot);
+        writeDirectorySlot(index, slot);
+
+        *where = rootSlot(slot);
+        return 0;
+    }
+
+    uint16 cluster = parent->entry.startingCluster;
+    uint16 last = cluster;
+    scanDirectory(cluster, NULL, NULL, NULL, NULL, where, &last);
+
+    if (where->lba == 0)
+    {
+        // Every slot is taken, add a cluster of empty ones
+        if (extendChain(last, 1, NULL) < 0)
+            return -1; // Disk full
+
+        uint16 added = getFatEntry(last);
+        uint8 empty[512];
+        for (uint16 i = 0; i < 512; i++)
+            empty[i] = 0;
+
+        logSector(33 + (added - 2), empty);
+        syncFAT();
+
+        where->lba = 33 + (added - 2);
+        where->offset = 0;
+    }
+
+    storeEntry(where, entry);
+    dentryStore(cluster, (char *)entry->filename, (char *)entry->extension, entry, where);
+
+    return 0;
+}
+
+// Mark filename.ext in a directory as deleted
+void removeEntry(directory_t *parent, char *filename, char *ext)
+{
+    dir_index_t *index = directoryIndex(parent);
+    if (index != NULL)
+    {
+        int16 slot = indexLookup(index, filename, ext);
+        if (slot >= 0)
+        {
+            indexRemove(index, slot);
+            index->entries[slot].filename[0] = 0xE5; // Deleted, the slots after it are still in use
+            index->next[slot] = index->freeHead;
+            index->freeHead = slot;
+            if (index->freeTail < 0)
+                index->freeTail = slot;
+            writeDirectorySlot(index, slot);
+        }
+        return;
+    }
+
+    directory_entry_t entry;
+    dir_slot_t where;
+    if (findEntry(parent, filename, ext, &entry, &where))
+    {
+        entry.filename[0] = 0xE5;
+        storeEntry(&where, &entry);
+        dentryStore(parent->entry.startingCluster, filename, ext, NULL, NULL);
+    }
+}
+
+// There is no clock, every time and date in a new entry is 0
+void clearEntryTimes(directory_entry_t *entry)
+{
+    entry->reserved = 0;
+    entry->creationTime = 0;
+    entry->creationDate = 0;
+    entry->lastAccessDate = 0;
+    entry->ignored = 0;
+    entry->lastWriteTime = 0;
+    entry->lastWriteDate = 0;
+}
+
+// Returns 1 if a subdirectory has nothing in it but "." and ".."
+int directoryIsEmpty(uint16 cluster)
+{
+    uint8 sector[512];
+    directory_entry_t *entries = (directory_entry_t *) sector;
+
+    while (cluster >= 2 && cluster < FAT_ENTRIES)
+    {
+        readMetadata(33 + (cluster - 2), sector);
+
+        for (uint16 i = 0; i < DIR_ENTRIES_PER_SECTOR; i++)
+        {
+            if (entries[i].filename[0] == 0x00)
+                return 1;
+
+            if (!slotIsFree(&entries[i]) && entries[i].filename[0] != '.')
+                return 0;
+        }
+
+        cluster = getFatEntry(cluster);
+    }
+
+    return 1;
+}
+
+// A subdirectory isn't loaded, its entries are read as they are looked up
+// Returns -1 if the entry isn't a directory
+int openDirectory(directory_t *directory)
+{
+    if (directory == NULL)
+        return -1;
+
+    if (directoryIndex(directory) == NULL)
+    {
+        if (!(directory->entry.attributes & FILE_ATTRIBUTE_DIRECTORY))
+            return -1;
+
+        directory->startingAddress = NULL;
+    }
+
+    directory->isOpened = 1;
+    return 0;
+}
+
+// Creates an empty subdirectory in parent, named by directory->entry.filename and extension
+// Its one cluster holds "." and ".." and nothing else
+int createDirectory(directory_t *directory, directory_t *parent)
+{
+    directory_entry_t existing;
+    dir_slot_t where;
+
+    if (directory == NULL || parent == NULL ||
+        findEntry(parent, (char *)directory->entry.filename, (char *)directory->entry.extension, &existing, &where))
+    {
+        return -1; // No parent, or the name is taken
+    }
+
+    uint16 cluster = allocateCluster();
+    if (cluster == 0)
+    {
+        return -1; // Disk full
+    }
+
+    directory->entry.attributes = FILE_ATTRIBUTE_DIRECTORY;
+    directory->entry.fileSize = 0;     // Directories have no size, their chain is as long as it is
+    directory->entry.startingCluster = cluster;
+    clearEntryTimes(&directory->entry);
+
+    uint8 sector[512];
+    for (uint16 i = 0; i < 512; i++)
+        sector[i] = 0;
+
+    directory_entry_t *entries = (directory_entry_t *) sector;
+    entries[0] = directory->entry;
+    stringcopy(".       ", (char *)entries[0].filename, 8);
+    stringcopy("   ", (char *)entries[0].extension, 3);
+    entries[1] = entries[0];
+    entries[1].filename[1] = '.';
+    entries[1].startingCluster = directoryIndex(parent) != NULL ? 0 : parent->entry.startingCluster;
+
+    logSector(33 + (cluster - 2), sector);
+
+    if (insertEntry(parent, &directory->entry, &where) < 0)
+    {
+        freeCluster(cluster);
+        return -1; // Parent full
+    }
+
+    syncFAT();
+    logEnd();
+
+    directory->startingAddress = NULL;
+    directory->isOpened = 0;
+    return 0;
+}
+
+// Deletes a subdirectory of parent, it must be empty
+int deleteDirectory(directory_t *directory, directory_t *parent)
+{
+    if (directory == NULL || parent == NULL || !(directory->entry.attributes & FILE_ATTRIBUTE_DIRECTORY) ||
+        !directoryIsEmpty(directory->entry.startingCluster))
+    {
+        return -1;
+    }
+
+    uint16 current = directory->entry.startingCluster;
+    while (current >= 2 && current < FAT_ENTRIES)
+    {
+        uint16 next = getFatEntry(current);
+        freeCluster(current);
+        current = next;
+    }
+    syncFAT();
+
+    dentryForget(directory->entry.startingCluster);
+    removeEntry(parent, (char *)directory->entry.filename, (char *)directory->entry.extension);
+    logEnd();
+
+    return 0;
+}
+
+// Turn the next name in a path into a padded 8.3 name, returns what is left of the path
+char *parseName(char *path, char *filename, char *ext)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        filename[i] = ' ';
+    for (i = 0; i < 3; i++)
+        ext[i] = ' ';
+
+    // "." and ".." are names of their own
+    i = 0;
+    while (*path == '.' && i < 2)
+        filename[i++] = *path++;
+
+    while (*path != '\0' && *path != '/' && *path != '.')
+    {
+        if (i < 8)
+            filename[i++] = *path;
+        path++;
+    }
+
+    if (*path == '.')
+    {
+        path++;
+        i = 0;
+        while (*path != '\0' && *path != '/')
+        {
+            if (i < 3)
+                ext[i++] = *path;
+            path++;
+        }
+    }
+
+    return path;
+}
+
+// Step from a directory into its subdirectory filename.ext
+// The root has no "." or ".." entries, both of them stay at the root
+int enterDirectory(directory_t *directory, char *filename, char *ext)
+{
+    directory_entry_t entry;
+    dir_slot_t where;
+
+    if (directoryIndex(directory) != NULL && filename[0] == '.' && (filename[1] == ' ' || filename[1] == '.'))
+        return 0;
+
+    if (!findEntry(directory, filename, ext, &entry, &where) || !(entry.attributes & FILE_ATTRIBUTE_DIRECTORY))
+        return -1;
+
+    // ".." of a directory in the root
+    if (entry.startingCluster == 0)
+    {
+        *directory = rootDirectory;
+        return 0;
+    }
+
+    directory->entry = entry;
+    directory->startingAddress = NULL;
+    directory->isOpened = 1;
+    return 0;
+}
+
+// Find the directory the last name of a path is in, and that name
+// Paths start at the root, "/a/b/c.txt" and "a/b/c.txt" are the same
+// Returns -1 if a directory on the way isn't there or the path names no file at all ("" or "/")
+int resolvePath(char *path, directory_t *parent, char *filename, char *ext)
+{
+    *parent = rootDirectory;
+
+    while (*path == '/')
+        path++;
+
+    path = parseName(path, filename, ext);
+    while (*path == '/')
+    {
+        while (*path == '/')
+            path++;
+
+        if (*path == '\0')
+            break;
+
+        // The name just parsed is a directory on the way
+        if (enterDirectory(parent, filename, ext) < 0)
+            return -1;
+
+        path = parseName(path, filename, ext);
+    }
+
+    if (filename[0] == ' ')
+        return -1;
+
+    return 0;
+}
+
+// Find the entry a path names, returns 1 if it is there
+int lookupPath(char *path, directory_entry_t *entry)
+{
+    directory_t parent;
+    char filename[8];
+    char ext[3];
+    dir_slot_t where;
+
+    if (resolvePath(path, &parent, filename, ext) < 0)
+        return 0;
+
+    return findEntry(&parent, filename, ext, entry, &where);
+}
+
+// Create the directory a path names, the directories above it must be there already
+int makeDirectory(char *path)
+{
+    directory_t parent;
+    directory_t directory;
+
+    if (resolvePath(path, &parent, (char *)directory.entry.filename, (char *)directory.entry.extension) < 0)
+        return -1;
+
+    return createDirectory(&directory, &parent);
+}
+
+// Initialize the file system on a block device
 // Loads the FATs and root directory
-void init_fs(directory_t *directory)
+void init_fs(int device, directory_t *directory)
+{
+    fsDevice = device;
+
+    // The FATs and directory go at 0x20000, 0x21200, and 0x22400
+    // These addresses were chosen because they are above the kernel, main() checks that it ends below 0x20000
+    // Their sectors are read the first time they are used (see fatLoad() and loadDirectorySector())
+
+    // The first copy of the FAT (Sector 1, 512 bytes * 9 sectors)
+    fat0 = (fat_t *) startAddress; // Put FAT at 0x20000
+
+    // The second copy of the FAT (Sector 10, 512 bytes * 9 sectors)
+    fat1 = (fat_t *) (startAddress+sizeof(fat_t)); // Put FAT at 0x21200
+
+    fatLoaded[0] = 0;
+    fatLoaded[1] = 0;
+    logMount();
+
+    // Nothing is waiting to be written, but the copies on the disk have never been compared
+    fatDirty = 0;
+    fatUnverified = (1 << FAT_SECTORS) - 1;
+
+    // The root directory (Sector 19, 512 bytes * 14 sectors)
+    directory->startingAddress = (uint8 *) (startAddress+(sizeof(fat_t)*2)); // Put ROOT at 0x22400
+
+    freeMapReady = 0;
+    buildDirectoryIndex(&rootIndex, (directory_entry_t *) directory->startingAddress, ROOT_ENTRIES, 19);
+
+    for (int i = 0; i < FILE_POOL_BLOCKS; i++)
+        filePoolUsed[i] = 0;
+    for (int i = 0; i < OPEN_FILE_MAX; i++)
+        openFiles[i].refCount = 0;
+    for (int fd = 0; fd < FD_MAX; fd++)
+        fds[fd].inUse = 0;
+
+    defragCursor = 0;
+    dentryInit();
+
+    readaheadNext = 0;
+    readaheadStats.sequential = 0;
+    readaheadStats.random = 0;
+    readaheadStats.window = 4;
+
+    directory->entry.filename[0] = 'R';
+    directory->entry.filename[1] = 'O';
+    directory->entry.filename[2] = 'O';
+    directory->entry.filename[3] = 'T';
+    directory->entry.attributes = FILE_ATTRIBUTE_DIRECTORY;
+    directory->entry.startingCluster = 0;   // What ".." of a directory in the root holds
+    directory->isOpened = 1;
+
+    rootDirectory = *directory;
+}
+
+// Reads one cluster and prefetches the next clusters of its chain
+// Contiguous clusters are prefetched together so they can share one floppy command
+int readCluster(uint16 cluster, void *address)
+{
+    if (cluster == readaheadNext)
+    {
+        readaheadStats.sequential++;
+        if (readaheadStats.window < READAHEAD_MAX_WINDOW)
+            readaheadStats.window *= 2;
+    }
+    else
+    {
+        readaheadStats.random++;
+        if (readaheadStats.window > READAHEAD_MIN_WINDOW)
+            readaheadStats.window /= 2;
+    }
+
+    int result = cache_read(fsDevice, 33 + (cluster - 2), address, 1);
+
+    readaheadNext = getFatEntry(cluster);
+
+    uint16 next = readaheadNext;
+    uint16 ahead = 0;
+    while (ahead < readaheadStats.window && next >= 2 && next < FAT_ENTRIES)
+    {
+        // Extend the run for as long as the chain stays contiguous
+        uint16 runStart = next;
+        uint16 runLength = 1;
+        next = getFatEntry(next);
+        while (ahead + runLength < readaheadStats.window && next == runStart + runLength)
+        {
+            runLength++;
+            next = getFatEntry(next);
+        }
+
+        cache_prefetch(fsDevice, 33 + (runStart - 2), runLength);
+        ahead += runLength;
+    }
+
+    return result;
+}
+
+void getReadaheadStats(readahead_stats_t *stats)
+{
+    *stats = readaheadStats;
+}
+
+// Unmount the file system
+// Commits the log and turns off write-back caching, which writes every dirty sector to the disk,
+// after which the log has nothing to replay
+void unmount_fs()
+{
+    syncFAT();
+    logCommit();
+    cache_set_write_back(0);
+    logClear();
+}
+
+void *allocateBuffer(uint32 bytes)
+{
+    int needed = (bytes + FILE_POOL_BLOCK_SIZE - 1) / FILE_POOL_BLOCK_SIZE;
+    int run = 0;
+
+    for (int i = 0; i < FILE_POOL_BLOCKS; i++)
+    {
+        run = filePoolUsed[i] ? 0 : run + 1;
+
+        if (run == needed)
+        {
+            int first = i - needed + 1;
+            for (int j = first; j <= i; j++)
+                filePoolUsed[j] = 1;
+            return (void *)(FILE_POOL_ADDRESS + first * FILE_POOL_BLOCK_SIZE);
+        }
+    }
+
+    return NULL;
+}
+
+void freeBuffer(void *buffer, uint32 bytes)
+{
+    int first = ((uint32) buffer - FILE_POOL_ADDRESS) / FILE_POOL_BLOCK_SIZE;
+    int count = (bytes + FILE_POOL_BLOCK_SIZE - 1) / FILE_POOL_BLOCK_SIZE;
+
+    for (int i = first; i < first + count && i < FILE_POOL_BLOCKS; i++)
+        filePoolUsed[i] = 0;
+}
+
+// Read every cluster of a file into buffer
+// Clusters that follow each other on the disk are read with one multi-sector transfer
+void readChain(file_t *file, uint8 *buffer)
+{
+    uint16 current = file->entry.startingCluster;
+    uint32 index = 0;
+
+    // If not EOF, load more data
+    while (current >= 2 && current < FAT_ENTRIES)
+    {
+        uint16 run = 1;
+        while (getFatEntry(current + run - 1) == current + run)
+            run++;
+
+        cache_read(fsDevice, 33 + (current - 2), (void *)(buffer + index), run);
+        index += run * 512; // Offset for next sector of data
+        current = getFatEntry(current + run - 1); // Get next cluster
+    }
+}
+
+// Write count sectors of a file, starting at sector first, from data
+// Sectors that follow each other on the disk go in one transfer
+void writeSectors(file_t *file, uint8 *data, uint16 first, uint16 count)
+{
+    uint16 i = 0;
+    while (i < count)
+    {
+        uint32 lba = fileOffsetToLba(file, (first + i) * 512);
+        uint16 run = 1;
+        while (i + run < count && fileOffsetToLba(file, (first + i + run) * 512) == lba + run)
+            run++;
+
+        cache_write(fsDevice, lba, (void *)(data + i * 512), run);
+        i += run;
+    }
+}
+
+// Read count sectors of a file, starting at sector first, into data
+// Sectors past the end of the chain are left as they are
+void readSectors(file_t *file, uint8 *data, uint16 first, uint16 count)
+{
+    uint16 i = 0;
+    while (i < count)
+    {
+        uint32 lba = fileOffsetToLba(file, (first + i) * 512);
+        if (lba == 0)
+            break;
+
+        uint16 run = 1;
+        while (i + run < count && fileOffsetToLba(file, (first + i + run) * 512) == lba + run)
+            run++;
+
+        cache_read(fsDevice, lba, (void *)(data + i * 512), run);
+        i += run;
+    }
+}
+
+// Grow or shrink a file's chain to sectors clusters, a file always keeps its first one
+// Growing takes everything in one go so the chain stays contiguous
+// Returns how many clusters the file has now, fewer than asked for if the disk is full
+uint16 fitChain(file_t *file, uint16 sectors)
+{
+    uint16 have = clusterCount(file);
+
+    if (sectors > have)
+    {
+        extendChain(fileCluster(file, have - 1), sectors - have, file);
+        return clusterCount(file);
+    }
+
+    if (sectors == 0)
+        sectors = 1;
+
+    if (sectors < have)
+    {
+        uint16 last = fileCluster(file, sectors - 1);
+        uint16 current = getFatEntry(last);
+        setFatEntry(last, 0xFFFF);
+
+        while (current >= 2 && current < FAT_ENTRIES)
+        {
+            uint16 next = getFatEntry(current);
+            freeCluster(current);
+            current = next;
+        }
+
+        buildExtentMap(file);
+    }
+
+    return sectors;
+}
+
+// LZ codec
+// The stream is a list of tokens, a token below 0x80 is followed by that many plus one literal
+// bytes, a token from 0x80 up copies (token & 0x7F) + 3 bytes from the 16 bit distance back that
+// follows it, which may overlap what it is writing
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (0x7F + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS 0x80
+#define LZ_HASH_SIZE 256
+
+// Compress size bytes of in to out, which has room for size bytes
+// Returns the compressed size, or 0 if it wouldn't be smaller
+uint16 lzCompress(uint8 *in, uint16 size, uint8 *out)
+{
+    uint16 last[LZ_HASH_SIZE];      // Position + 1 of the last 3 bytes with each hash, 0 for none
+    uint16 i = 0;
+    uint16 o = 0;
+    uint16 literals = 0;            // Bytes before i still waiting to go out as literals
+
+    for (uint16 h = 0; h < LZ_HASH_SIZE; h++)
+        last[h] = 0;
+
+    while (i <= size)
+    {
+        uint16 match = 0;
+        uint16 distance = 0;
+
+        if (i + LZ_MIN_MATCH <= size)
+        {
+            uint16 h = (in[i] * 33 * 33 + in[i + 1] * 33 + in[i + 2]) % LZ_HASH_SIZE;
+
+            if (last[h] != 0)
+            {
+                uint16 from = last[h] - 1;
+                while (i + match < size && match < LZ_MAX_MATCH && in[from + match] == in[i + match])
+                    match++;
+                distance = i - from;
+            }
+            last[h] = i + 1;
+        }
+
+        // Literals go out before a match, when there are as many as a token holds, and at the end
+        if (literals > 0 && (match >= LZ_MIN_MATCH || literals == LZ_MAX_LITERALS || i == size))
+        {
+            if (o + 1 + literals >= size)
+                return 0;
+
+            out[o++] = literals - 1;
+            memcpy(&out[o], &in[i - literals], literals);
+            o += literals;
+            literals = 0;
+        }
+
+        if (i == size)
+            break;
+
+        if (match >= LZ_MIN_MATCH)
+        {
+            if (o + 3 >= size)
+                return 0;
+
+            out[o++] = 0x80 | (match - LZ_MIN_MATCH);
+            out[o++] = distance;
+            out[o++] = distance >> 8;
+            i += match;
+        }
+        else
+        {
+            literals++;
+            i++;
+        }
+    }
+
+    return o;
+}
+
+// Decompress size bytes of in to out, writing at most limit bytes
+void lzDecompress(uint8 *in, uint16 size, uint8 *out, uint16 limit)
+{
+    uint16 i = 0;
+    uint16 o = 0;
+
+    while (i < size)
+    {
+        uint8 token = in[i++];
+
+        if (token < 0x80)
+        {
+            for (uint16 n = 0; n <= token && i < size && o < limit; n++)
+                out[o++] = in[i++];
+        }
+        else
+        {
+            if (i + 1 >= size)
+                return; // Corrupt, the distance is cut off
+
+            uint16 length = (token & 0x7F) + LZ_MIN_MATCH;
+            uint16 distance = in[i] | (in[i + 1] << 8);
+            i += 2;
+
+            if (distance == 0 || distance > o)
+                return; // Corrupt
+
+            for (uint16 n = 0; n < length && o < limit; n++, o++)
+                out[o] = out[o - distance];
+        }
+    }
+}
+
+// Compressed files
+// A file with FILE_ATTRIBUTE_COMPRESSED set starts with a one sector header holding its real size
+// (uint32) and a slot (uint16) for each group of COMPRESS_GROUP_SECTORS sectors, the groups follow
+// one after the other from the second sector on, each starting on a sector of its own
+// A slot has the stored length of its group, whether it is stored as it is (it didn't get smaller)
+// and how many sectors the group takes, which can be more than the length needs: a group that
+// shrinks keeps its sectors, so it can grow back without moving the groups after it
+// Each group is compressed on its own, so a descriptor reads any group without the ones before it,
+// and rewriting a group only writes that group and the header
+// A group of zeroes that was never written takes no sectors
+// The directory entry has the stored size, everything in memory sees the real size
+#define COMPRESS_GROUP_SECTORS FD_WINDOW_SECTORS   // One group fills a descriptor window
+#define COMPRESS_GROUP_BYTES (COMPRESS_GROUP_SECTORS * 512)
+#define COMPRESS_HEADER_BYTES 512
+#define COMPRESS_MAX_GROUPS ((COMPRESS_HEADER_BYTES - 4) / 2)
+#define COMPRESS_MAX_SIZE (COMPRESS_MAX_GROUPS * COMPRESS_GROUP_BYTES)
+#define compressedGroups(size) (((size) + COMPRESS_GROUP_BYTES - 1) / COMPRESS_GROUP_BYTES)
+
+#define SLOT_LENGTH 0x07FF          // Stored bytes, up to COMPRESS_GROUP_BYTES
+#define SLOT_RAW 0x0800             // Stored as it is
+#define slotLength(slot) ((slot) & SLOT_LENGTH)
+#define slotSectors(slot) ((slot) >> 12)
+#define makeSlot(length, raw, sectors) ((length) | ((raw) ? SLOT_RAW : 0) | ((sectors) << 12))
+
+typedef struct
+{
+    uint32 size;
+    uint16 slots[COMPRESS_MAX_GROUPS];
+} __attribute__((packed)) compress_header_t;
+
+// Bytes in group g of a file of size bytes
+uint16 groupBytes(uint32 size, uint16 g)
+{
+    uint32 left = size - g * COMPRESS_GROUP_BYTES;
+    return left < COMPRESS_GROUP_BYTES ? left : COMPRESS_GROUP_BYTES;
+}
+
+// The sector group g starts at in the stored file
+uint16 groupSector(compress_header_t *header, uint16 g)
+{
+    uint16 sector = COMPRESS_HEADER_BYTES / 512;
+    for (uint16 i = 0; i < g; i++)
+        sector += slotSectors(header->slots[i]);
+    return sector;
+}
+
+// Compress length bytes of group into block, which has room for COMPRESS_GROUP_BYTES
+// Returns the group's slot, with as few sectors as it needs
+uint16 encodeGroup(uint8 *group, uint16 length, uint8 *block)
+{
+    uint16 stored = lzCompress(group, length, block);
+    if (stored > 0)
+        return makeSlot(stored, 0, (stored + 511) / 512);
+
+    memcpy(block, group, length);
+    return makeSlot(length, 1, (length + 511) / 512);
+}
+
+// Turn a stored group back into its length bytes
+// What the stored group doesn't cover (it was written when the file was shorter) reads as zeroes
+void decodeGroup(uint16 slot, uint8 *block, uint8 *group, uint16 length)
+{
+    for (uint16 i = 0; i < length; i++)
+        group[i] = 0;
+
+    if (slot & SLOT_RAW)
+        memcpy(group, block, slotLength(slot) < length ? slotLength(slot) : length);
+    else
+        lzDecompress(block, slotLength(slot), group, length);
+}
+
+// Read the header of a compressed file, a file with nothing stored yet has an empty one
+// Returns -1 (with an empty header) if the header can't be right
+int loadHeader(open_file_t *open, compress_header_t *header)
+{
+    header->size = 0;
+    if (open->storedSize < COMPRESS_HEADER_BYTES)
+        return 0;
+
+    cache_read(fsDevice, fileOffsetToLba(&open->file, 0), header, 1);
+
+    uint16 groups = compressedGroups(header->size);
+    int bad = header->size > COMPRESS_MAX_SIZE;
+    for (uint16 g = 0; !bad && g < groups; g++)
+    {
+        uint16 slot = header->slots[g];
+        bad = slotSectors(slot) > COMPRESS_GROUP_SECTORS || slotLength(slot) > slotSectors(slot) * 512;
+    }
+
+    if (bad || groupSector(header, groups) * 512 > open->storedSize)
+    {
+        header->size = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Decompress the whole file from the disk into raw
+// Returns -1 if there is no buffer space to read it into or the header is damaged
+int loadCompressed(open_file_t *open, uint8 *raw)
+{
+    compress_header_t header;
+
+    // Descriptors may have grown the file since, what is on the disk has its own size
+    if (loadHeader(open, &header) < 0)
+        return -1;
+
+    uint16 groups = compressedGroups(header.size);
+    uint16 first = groupSector(&header, 0);
+    uint16 sectors = groupSector(&header, groups) - first;
+
+    uint8 *stored = NULL;
+    if (sectors > 0)
+    {
+        stored = allocateBuffer(sectors * 512);
+        if (stored == NULL)
+            return -1;
+
+        readSectors(&open->file, stored, first, sectors);
+    }
+
+    uint8 *block = stored;
+    for (uint16 g = 0; g < groups; g++)
+    {
+        decodeGroup(header.slots[g], block, raw + g * COMPRESS_GROUP_BYTES, groupBytes(header.size, g));
+        block += slotSectors(header.slots[g]) * 512;
+    }
+
+    if (stored != NULL)
+        freeBuffer(stored, sectors * 512);
+    return 0;
+}
+
+// Compress the whole file from raw and write it out, each group in as few sectors as it needs
+// The chain grows or shrinks to fit
+// Returns -1 if there is no buffer space or the disk is full, the old copy stays then
+int storeCompressed(open_file_t *open, uint8 *raw)
+{
+    compress_header_t header;
+    file_t *file = &open->file;
+    uint32 size = file->entry.fileSize;
+    uint16 groups = compressedGroups(size);
+    if (size > COMPRESS_MAX_SIZE)
+        return -1;
+
+    uint32 bytes = groups * COMPRESS_GROUP_BYTES;   // Nothing getting smaller is the worst case
+    uint8 *stored = NULL;
+    if (bytes > 0)
+    {
+        stored = allocateBuffer(bytes);
+        if (stored == NULL)
+            return -1;
+    }
+
+    uint16 first = COMPRESS_HEADER_BYTES / 512;
+    uint16 sectors = 0;
+    for (uint16 g = 0; g < groups; g++)
+    {
+        header.slots[g] = encodeGroup(raw + g * COMPRESS_GROUP_BYTES, groupBytes(size, g), stored + sectors * 512);
+        sectors += slotSectors(header.slots[g]);
+    }
+
+    uint16 have = clusterCount(file);
+    if (fitChain(file, first + sectors) < first + sectors)
+    {
+        fitChain(file, have);   // Give back whatever was added
+        if (stored != NULL)
+            freeBuffer(stored, bytes);
+        return -1;
+    }
+
+    header.size = size;
+    writeSectors(file, stored, first, sectors);
+    writeSectors(file, (uint8 *)&header, 0, 1);
+    if (stored != NULL)
+        freeBuffer(stored, bytes);
+
+    open->storedSize = (first + sectors) * 512;
+    open->sizeChanged = 1;
+    return 0;
+}
+
+// Fill the window with the group holding offset, decompressed
+// Only the header and the sectors of the group are read
+// Returns -1 if there is no buffer space or the header is damaged
+int loadGroup(open_file_t *open, uint32 offset)
+{
+    compress_header_t header;
+    if (loadHeader(open, &header) < 0)
+        return -1;
+
+    uint16 g = offset / COMPRESS_GROUP_BYTES;
+    open->windowOffset = g * COMPRESS_GROUP_BYTES;
+    open->windowSectors = COMPRESS_GROUP_SECTORS;
+
+    // Past what is stored reads as zeroes
+    for (uint16 i = 0; i < COMPRESS_GROUP_BYTES; i++)
+        open->window[i] = 0;
+
+    if (g >= compressedGroups(header.size))
+        return 0;
+
+    uint8 *block = allocateBuffer(COMPRESS_GROUP_BYTES);
+    if (block == NULL)
+        return -1;
+
+    readSectors(&open->file, block, groupSector(&header, g), slotSectors(header.slots[g]));
+    decodeGroup(header.slots[g], block, open->window, groupBytes(header.size, g));
+
+    freeBuffer(block, COMPRESS_GROUP_BYTES);
+    return 0;
+}
+
+// Put a written window back into a compressed file
+// Only the window's group and the header are written while the group fits its sectors, or is the
+// last one; one that outgrows its sectors with groups after it gets COMPRESS_GROUP_SECTORS, which it
+// can't outgrow again, and the groups after it move up once
+// Returns -1 if there is no buffer space or the disk is full, what is on the disk is left alone then
+int storeWindow(open_file_t *open)
+{
+    compress_header_t header;
+    if (loadHeader(open, &header) < 0)
+        return -1;
+
+    file_t *file = &open->file;
+    uint32 size = file->entry.fileSize;
+    if (size > COMPRESS_MAX_SIZE)
+        return -1;
+
+    // Groups between the end of what is stored and the window are zeroes, and take no sectors
+    uint16 g = open->windowOffset / COMPRESS_GROUP_BYTES;
+    uint16 groups = compressedGroups(header.size);
+    for (uint16 i = groups; i < g; i++)
+        header.slots[i] = makeSlot(0, 0, 0);
+    if (groups <= g)
+    {
+        header.slots[g] = makeSlot(0, 0, 0);
+        groups = g + 1;
+    }
+
+    uint8 *block = allocateBuffer(COMPRESS_GROUP_BYTES);
+    if (block == NULL)
+        return -1;
+
+    uint16 slot = encodeGroup(open->window, groupBytes(size, g), block);
+    uint16 sector = groupSector(&header, g);
+    uint16 next = sector + slotSectors(header.slots[g]);   // Where the groups after it start
+    uint16 end = groupSector(&header, groups);
+    uint16 move = 0;
+
+    if (slotSectors(slot) <= slotSectors(header.slots[g]))
+        slot = makeSlot(slotLength(slot), slot & SLOT_RAW, slotSectors(header.slots[g]));
+    else if (g + 1 < groups)
+    {
+        move = COMPRESS_GROUP_SECTORS - slotSectors(header.slots[g]);
+        slot = makeSlot(slotLength(slot), slot & SLOT_RAW, COMPRESS_GROUP_SECTORS);
+    }
+
+    uint8 *scratch = NULL;
+    if (move > 0)
+    {
+        scratch = allocateBuffer(COMPRESS_GROUP_BYTES);
+        if (scratch == NULL)
+        {
+            freeBuffer(block, COMPRESS_GROUP_BYTES);
+            return -1;
+        }
+    }
+
+    uint16 written = (slotLength(slot) + 511) / 512;
+    header.slots[g] = slot;
+    uint16 sectors = groupSector(&header, groups);
+
+    uint16 have = clusterCount(file);
+    if (fitChain(file, sectors) < sectors)
+    {
+        fitChain(file, have);   // Give back whatever was added
+        if (scratch != NULL)
+            freeBuffer(scratch, COMPRESS_GROUP_BYTES);
+        freeBuffer(block, COMPRESS_GROUP_BYTES);
+        return -1;
+    }
+
+    // From the end down, so nothing is overwritten before it has been read
+    while (end > next && move > 0)
+    {
+        uint16 count = end - next < COMPRESS_GROUP_SECTORS ? end - next : COMPRESS_GROUP_SECTORS;
+        end -= count;
+        readSectors(file, scratch, end, count);
+        writeSectors(file, scratch, end + move, count);
+    }
+
+    header.size = size;
+    writeSectors(file, block, sector, written);
+    writeSectors(file, (uint8 *)&header, 0, 1);
+
+    if (scratch != NULL)
+        freeBuffer(scratch, COMPRESS_GROUP_BYTES);
+    freeBuffer(block, COMPRESS_GROUP_BYTES);
+
+    open->storedSize = sectors * 512;
+    open->sizeChanged = 1;
+    return 0;
+}
+
+// Write the dirty sectors of the window back through the cache
+// Returns -1 if they couldn't be written, a compressed window stays dirty then
+int flushWindow(open_file_t *open)
+{
+    if (open->file.entry.attributes & FILE_ATTRIBUTE_COMPRESSED)
+    {
+        if (open->windowDirty && storeWindow(open) < 0)
+            return -1;
+
+        open->windowDirty = 0;
+        return 0;
+    }
+
+    int result = 0;
+    uint16 i = 0;
+    while (i < open->windowSectors)
+    {
+        if (!(open->windowDirty & (1 << i)))
+        {
+            i++;
+            continue;
+        }
+
+        // Dirty sectors that follow each other in the file and on the disk go in one transfer
+        uint32 lba = fileOffsetToLba(&open->file, open->windowOffset + i * 512);
+        uint16 run = 1;
+        while (i + run < open->windowSectors && (open->windowDirty & (1 << (i + run))) &&
+               fileOffsetToLba(&open->file, open->windowOffset + (i + run) * 512) == lba + run)
+            run++;
+
+        if (cache_write(fsDevice, lba, (void *)&open->window[i * 512], run) < 0)
+            result = -1;
+        i += run;
+    }
+
+    open->windowDirty = 0;
+    return result;
+}
+
+// Point the window at the sector holding offset and read as many of the file's sectors from there
+// as fit, contiguous sectors are read with one cache_read
+// Returns -1 if the file has no cluster at offset or the window's old contents couldn't be written
+int loadWindow(open_file_t *open, uint32 offset)
+{
+    if (flushWindow(open) < 0)
+        return -1;
+
+    if (open->file.entry.attributes & FILE_ATTRIBUTE_COMPRESSED)
+        return loadGroup(open, offset);
+
+    open->windowOffset = offset & ~511;
+    open->windowSectors = 0;
+
+    while (open->windowSectors < FD_WINDOW_SECTORS)
+    {
+        uint32 lba = fileOffsetToLba(&open->file, open->windowOffset + open->windowSectors * 512);
+        if (lba == 0)
+            break;
+
+        uint16 run = 1;
+        while (open->windowSectors + run < FD_WINDOW_SECTORS &&
+               fileOffsetToLba(&open->file, open->windowOffset + (open->windowSectors + run) * 512) == lba + run)
+        {
+            run++;
+        }
+
+        cache_read(fsDevice, lba, (void *)&open->window[open->windowSectors * 512], run);
+        open->windowSectors += run;
+    }
+
+    return open->windowSectors > 0 ? 0 : -1;
+}
+
+// Make sure the window holds the sector at offset, returns where offset is in the window
+int windowFor(open_file_t *open, uint32 offset)
+{
+    if (open->window == NULL)
+    {
+        open->window = allocateBuffer(FD_WINDOW_SECTORS * 512);
+        if (open->window == NULL)
+            return -1;
+    }
+
+    if (open->windowSectors == 0 || offset < open->windowOffset ||
+        offset >= open->windowOffset + open->windowSectors * 512)
+    {
+        if (loadWindow(open, offset) < 0)
+            return -1;
+    }
+
+    return offset - open->windowOffset;
+}
+
+// Take a reference to the open-file entry of a file, adding one if the file isn't open yet
+// where says where the file's directory entry is, pass NULL to have it looked up in the root
+// Returns the entry, or -1 if the table is full
+int16 acquireOpenFile(dir_slot_t *where, directory_entry_t *entry)
+{
+    int16 free = -1;
+    dir_slot_t slot;
+
+    if (where != NULL)
+    {
+        slot = *where;
+    }
+    else
+    {
+        int16 rootSlotIndex = indexLookup(&rootIndex, (char *)entry->filename, (char *)entry->extension);
+        slot.lba = 0;
+        if (rootSlotIndex >= 0)
+            slot = rootSlot(rootSlotIndex);
+    }
+
+    // A file is known by its directory entry, empty files all have cluster 0, so the first cluster
+    // only tells files apart when the entry wasn't found
+    for (int16 i = 0; i < OPEN_FILE_MAX; i++)
+    {
+        if (openFiles[i].refCount == 0)
+        {
+            if (free < 0)
+                free = i;
+            continue;
+        }
+
+        int same = slot.lba != 0 ?
+                   openFiles[i].where.lba == slot.lba && openFiles[i].where.offset == slot.offset :
+                   entry->startingCluster >= 2 && openFiles[i].file.entry.startingCluster == entry->startingCluster;
+        if (same)
+        {
+            openFiles[i].refCount++;
+            return i;
+        }
+    }
+
+    if (free < 0)
+        return -1; // Too many open files
+
+    open_file_t *open = &openFiles[free];
+    open->where = slot;
+
+    open->refCount = 1;
+    open->loading = 0;
+    open->bufferSize = 0;
+    for (int word = 0; word < FILE_POOL_BLOCKS / 32; word++)
+        open->bufferDirty[word] = 0;
+    open->sizeChanged = 0;
+    open->preallocated = 0;
+    open->window = NULL;
+    open->windowSectors = 0;
+    open->windowDirty = 0;
+
+    open->file.entry = *entry;
+    open->file.startingAddress = NULL;
+    open->file.isOpened = 1;
+    open->file.openFile = free;
+    buildExtentMap(&open->file);
+
+    // The real size of a compressed file is in its header
+    open->storedSize = entry->fileSize;
+    if (entry->attributes & FILE_ATTRIBUTE_COMPRESSED)
+    {
+        compress_header_t header;
+        loadHeader(open, &header);
+        open->file.entry.fileSize = header.size;
+    }
+
+    return free;
+}
+
+// Write the window, the new size if it changed, and the FAT
+// Returns -1 if the window couldn't be written
+int saveOpenFile(open_file_t *open)
+{
+    int result = flushWindow(open);
+
+    if (open->sizeChanged && open->where.lba != 0)
+    {
+        // Only the size and whether it is compressed change, whatever else happened to the entry
+        // since it was opened stays
+        directory_entry_t entry;
+        loadEntry(&open->where, &entry);
+        entry.attributes = (entry.attributes & ~FILE_ATTRIBUTE_COMPRESSED) |
+                           (open->file.entry.attributes & FILE_ATTRIBUTE_COMPRESSED);
+        entry.fileSize = open->file.entry.attributes & FILE_ATTRIBUTE_COMPRESSED ? open->storedSize :
+                         open->file.entry.fileSize;
+        storeEntry(&open->where, &entry);
+    }
+    open->sizeChanged = 0;
+
+    syncFAT();
+    logEnd();
+
+    return result;
+}
+
+// Drop a reference, the last one frees the buffers
+void releaseOpenFile(int16 i)
+{
+    open_file_t *open = &openFiles[i];
+
+    if (--open->refCount > 0)
+        return;
+
+    if (open->window != NULL)
+        freeBuffer(open->window, FD_WINDOW_SECTORS * 512);
+    if (open->file.startingAddress != NULL)
+        freeBuffer(open->file.startingAddress, open->bufferSize);
+
+    open->window = NULL;
+    open->file.startingAddress = NULL;
+}
+
+#define bufferSectorDirty(open, sector) ((open)->bufferDirty[(sector) / 32] & (1UL << ((sector) % 32)))
+
+// Write the sectors of the whole-file buffer that changed since they were last written
+// Dirty sectors that follow each other in the file and on the disk go in one transfer, a compressed
+// file is stored again as a whole if anything in it changed
+// Returns -1 if the disk filled up (or a compressed file couldn't be stored, it stays dirty then)
+int flushBuffer(open_file_t *open)
+{
+    file_t *file = &open->file;
+    uint16 sectors = (file->entry.fileSize + 511) / 512;
+    int result = 0;
+
+    if (file->entry.attributes & FILE_ATTRIBUTE_COMPRESSED)
+    {
+        for (uint16 i = 0; i < sectors; i++)
+        {
+            if (bufferSectorDirty(open, i))
+            {
+                if (storeCompressed(open, file->startingAddress) < 0)
+                    return -1;
+                break;
+            }
+        }
+    }
+    else
+    {
+        // Preallocated clusters past the end stay with the file
+        uint16 keep = sectors > open->preallocated ? sectors : open->preallocated;
+        uint16 have = fitChain(file, keep);
+        if (have < sectors)
+        {
+            sectors = have;     // Disk full, the rest of the file is lost
+            result = -1;
+        }
+
+        uint16 i = 0;
+        while (i < sectors)
+        {
+            uint16 run = 0;
+            while (i + run < sectors && bufferSectorDirty(open, i + run))
+                run++;
+
+            if (run > 0)
+                writeSectors(file, file->startingAddress + i * 512, i, run);
+            i += run + 1;
+        }
+    }
+
+    for (int word = 0; word < FILE_POOL_BLOCKS / 32; word++)
+        open->bufferDirty[word] = 0;
+
+    return result;
+}
+
+// Turn compression of a file loaded with openFile() on or off
+// The file is stored in its new form when it is next flushed or closed
+// Returns -1 if the file isn't loaded, is too big to compress or its window couldn't be written
+int setCompression(file_t *file, int compressed)
+{
+    if (file == NULL || file->isOpened != 1)
+        return -1;
+
+    open_file_t *open = &openFiles[file->openFile];
+    if (open->file.startingAddress == NULL)
+        return -1;
+
+    uint8 attributes = open->file.entry.attributes & ~FILE_ATTRIBUTE_COMPRESSED;
+    if (compressed)
+        attributes |= FILE_ATTRIBUTE_COMPRESSED;
+
+    if (compressed && open->file.entry.fileSize > COMPRESS_MAX_SIZE)
+        return -1;
+
+    if (attributes != open->file.entry.attributes)
+    {
+        // A descriptor window holds the old form, it is written back in that form first
+        if (flushWindow(open) < 0)
+            return -1;
+        open->windowSectors = 0;
+
+        open->file.entry.attributes = attributes;
+        for (uint16 i = 0; i < (open->file.entry.fileSize + 511) / 512; i++)
+            open->bufferDirty[i / 32] |= 1UL << (i % 32);
+        open->sizeChanged = 1;
+    }
+
+    file->entry.attributes = attributes;
+    return 0;
+}
+
+// Writes what changed in the file's buffer, and its new size, to the disk without closing it
+// Returns -1 if not all of it could be written
+int flushFile(file_t *file)
+{
+    if (file == NULL || file->isOpened != 1)
+        return -1;
+
+    open_file_t *open = &openFiles[file->openFile];
+
+    // The window may hold writes from descriptors, they go first so the buffer has the last word
+    int result = flushWindow(open);
+    if (open->file.startingAddress != NULL && flushBuffer(open) < 0)
+        result = -1;
+    if (result == 0)
+        open->windowSectors = 0;    // Reload descriptor windows from what was just written
+
+    // Write out the size and the FAT sectors the file grew into
+    if (saveOpenFile(open) < 0)
+        result = -1;
+    file->entry = open->file.entry;
+
+    return result;
+}
+
+// Writes the sectors of the file that changed back from its buffer and drops this opener's reference
+// They are written on every close, so what one opener wrote is on the disk when it closes even
+// if others still have the file open
+// Returns -1 if not all of it could be written, the reference is dropped anyway
+int closeFile(file_t *file)
+{
+    if (file != NULL && file->isOpened == 1)
+    {
+        // The last close trims the chain to the file
+        open_file_t *open = &openFiles[file->openFile];
+        if (open->refCount == 1)
+            open->preallocated = 0;
+
+        int result = flushFile(file);
+        releaseOpenFile(file->openFile);
+        file->isOpened = 0; // Make file open false (closed)
+        return result;
+
+    } else {
+        return -1; // Cannot close file
+    }
+}
+
+// Loads the whole file into a buffer from the file buffer pool
+// If the file is already open, by this or another process, this shares its buffer instead of
+// reading it again
+int openFile(file_t *file)
+{
+    if (file != NULL)
+    {
+        int16 i = acquireOpenFile(NULL, &file->entry);
+        if (i < 0)
+        {
+            return -1; // Open-file table full
+        }
+
+        open_file_t *open = &openFiles[i];
+
+        // Someone else is reading the file in, wait for them instead of reading it twice
+        while (open->loading)
+            yield();
+
+        if (open->file.startingAddress == NULL)
+        {
+            open->loading = 1;
+
+            // Room for one more sector than the file has, so writeByte() can add to it
+            uint32 size = (clusterCount(&open->file) + 1) * 512;
+            if (open->file.entry.attributes & FILE_ATTRIBUTE_COMPRESSED)
+                size = ((open->file.entry.fileSize + 511) / 512 + 1) * 512;
+            uint8 *buffer = allocateBuffer(size);
+            if (buffer == NULL)
+            {
+                open->loading = 0;
+                releaseOpenFile(i);
+                return -1; // Out of buffer space
+            }
+
+            // Pending writes from descriptors have to be on the disk before it is read
+            if (flushWindow(open) < 0)
+            {
+                freeBuffer(buffer, size);
+                open->loading = 0;
+                releaseOpenFile(i);
+                return -1;
+            }
+
+            if (!(open->file.entry.attributes & FILE_ATTRIBUTE_COMPRESSED))
+            {
+                readChain(&open->file, buffer);
+            }
+            else if (loadCompressed(open, buffer) < 0)
+            {
+                freeBuffer(buffer, size);
+                open->loading = 0;
+                releaseOpenFile(i);
+                return -1; // Out of buffer space
+            }
+
+            open->file.startingAddress = buffer;
+            open->bufferSize = size;
+            open->loading = 0;
+        }
+
+        *file = open->file; // Make file open true, with the shared buffer
+
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Creates an empty file and writes it to the floppy disk
+// You can see the effects of calling this function by viewing your OS image in a hex editor
+// Your OS image will be updated to contain the following:
+// FAT Tables changes:
+// 0x0266 - 0x0267: 0xFFFF (FAT entry) (First FAT table)
+// 0x1466 - 0x1467: 0xFFFF (FAT entry) (Second FAT table)
+// Root Directory changes:
+// 0x2620 - 0x263F: Directory entry for our new file (contains filename, extension, startingCluster, filesize, etc.)
+// File changes:
+// 0xA400 - 0xA5FF: Our file (1 sector) contains either 0's or "Hello World!\n"
+int createFile(file_t *file, directory_t *parent)
+{
+    // IFF file and parent exists
+    if (file != NULL && parent != NULL)
+    {
+        uint16 cluster = allocateCluster();
+        if (cluster == 0)
+        {
+            return -1; // Disk full
+        }
+
+        // Set up metadata for new file
+        file->entry.attributes = 0x00;   // Normal file code
+        file->entry.fileSize = 0;        // 0 because no data stored
+
+        // Starts out as a single EOF cluster because no data is stored yet
+        file->entry.startingCluster = cluster;
+        clearEntryTimes(&file->entry);
+
+        dir_slot_t where;
+        if (insertEntry(parent, &file->entry, &where) < 0)
+        {
+            freeCluster(cluster);
+            return -1; // Directory full
+        }
+
+        buildExtentMap(file);
+        file->isOpened = 0;             // Not open, nothing to write back yet
+
+        // The cluster and the entry go in the same group
+        syncFAT();
+        logEnd();
+    } else {
+
+        return -1; // No file or parent directory found
+    }
+
+    return 0;
+}
+
+void deleteFile(file_t *file, directory_t *parent)
+{
+    if (file != NULL && parent != NULL)
+    {
+        uint16 current = file->entry.startingCluster;   // get cluster of file
+
+        // Loop thru clusters until EOF (Last cluster), an empty file has none
+        while (current >= 2 && current < FAT_ENTRIES)
+        {
+            uint16 next = getFatEntry(current);       // entries[cluster] has next cluster #
+            freeCluster(current);                       // Make cluster empty
+            current = next;
+        }
+
+        // Sync FAT1 with FAT0
+        syncFAT();
+
+        // Updating parent directory by removing directory entry as per instruction
+        // Extension is needed because test.py != test.txt, they're different files
+        removeEntry(parent, (char *)file->entry.filename, (char *)file->entry.extension);
+        logEnd();
+
+    } else {
+        return; // File or parent directory not found
+    }
+}
+
+// Returns a byte from a file that is currently loaded into memory
+// This does NOT modify the floppy disk
+// This function requires the file to have been loaded into memory with openFile()
+uint8 readByte(file_t *file, uint32 index)
+{
+    if (file != NULL && file->isOpened && index < openFiles[file->openFile].bufferSize)
+        return *((uint8 *)(file->startingAddress + index));
+    return 0;
+}
+
+// Writes a byte to a file that is currently loaded into memory
+// This does NOT modify the floppy disk
+// To write this to the floppy disk, we have to call closeFile()
+int writeByte(file_t *file, uint8 byte, uint32 index)
+{
+    if (!file->isOpened)
+    {
+        return -1; //File not opened
+    }
+
+    open_file_t *open = &openFiles[file->openFile];
+    if (index >= open->bufferSize)
+    {
+        return -1; // Past the end of the buffer
+    }
+
+    *((uint8 *)(file->startingAddress + index)) = byte; // Add bye to index
+    open->bufferDirty[index / 512 / 32] |= 1UL << (index / 512 % 32);
+
+    // The size is the furthest byte written, overwriting a byte doesn't grow the file
+    if (index >= open->file.entry.fileSize)
+    {
+        open->file.entry.fileSize = index + 1;          // Update file size, every opener sees it
+        open->sizeChanged = 1;
+    }
+    file->entry.fileSize = open->file.entry.fileSize;
+
+    return 0;
+}
+
+int findFile(char *filename, char* ext, directory_t directory, directory_entry_t *foundEntry)
+{
+	dir_slot_t where;
+
+	return findEntry(&directory, filename, ext, foundEntry, &where);
+}
+
+// Renames the file in the parent directory entry with the new filename and extension.
+// Once the parent directory entry is modified, the changes must be written to the floppy disk using cache_write()
+void renameFile(file_t *file, directory_t *parent, char *newFilename, char *newExtension)
+{
+    dir_index_t *index = parent != NULL ? directoryIndex(parent) : NULL;
+
+    // Pre check
+    if (file == NULL || parent == NULL)
+    {
+        return; // Invalid file or parent directory
+    }
+
+    // A subdirectory's entry is renamed where it is, and the dentry cache learns both names
+    if (index == NULL)
+    {
+        directory_entry_t entry;
+        dir_slot_t where;
+        if (!findEntry(parent, (char *)file->entry.filename, (char *)file->entry.extension, &entry, &where))
+        {
+            return;
+        }
+
+        stringcopy(newFilename, (char *)entry.filename, 8);
+        stringcopy(newExtension, (char *)entry.extension, 3);
+        storeEntry(&where, &entry);
+
+        dentryStore(parent->entry.startingCluster, (char *)file->entry.filename, (char *)file->entry.extension, NULL, NULL);
+        dentryStore(parent->entry.startingCluster, newFilename, newExtension, &entry, &where);
+
+        stringcopy(newFilename, (char *)file->entry.filename, 8);
+        stringcopy(newExtension, (char *)file->entry.extension, 3);
+        logEnd();
+        return;
+    }
+
+    // Search for the file in the parent directory
+    int16 slot = indexLookup(index, (char *)file->entry.filename, (char *)file->entry.extension);
+    if (slot < 0)
+    {
+        return;
+    }
+
+    directory_entry_t *entry = &index->entries[slot];
+
+    // The entry moves to the bucket of its new name
+    indexRemove(index, slot);
+
+    // Update filename and extension
+    stringcopy(newFilename, (char *)entry->filename, 8);
+    stringcopy(newExtension, (char *)entry->extension, 3);
+
+    indexInsert(index, slot);
+
+    // Write the sector holding the entry back to disk
+    writeDirectorySlot(index, slot);
+    logEnd();
+
+    // Update the file's metadata in memory
+    stringcopy(newFilename, (char *)file->entry.filename, 8);
+    stringcopy(newExtension, (char *)file->entry.extension, 3);
+}
+
+// File descriptor calls
+fd_t *getDescriptor(int fd)
+{
+    if (fd < 0 || fd >= FD_MAX || !fds[fd].inUse)
+        return NULL;
+
+    return &fds[fd];
+}
+
+// Open filename.ext in parent, creating it first if flags has O_CREAT
+// Returns a file descriptor, or -1 if the file isn't there or no descriptor is free
+int open(directory_t *parent, char *filename, char *ext, int flags)
+{
+    if (parent == NULL)
+        return -1;
+
+    int fd = 0;
+    while (fd < FD_MAX && fds[fd].inUse)
+        fd++;
+
+    if (fd == FD_MAX)
+        return -1; // Too many open files
+
+    directory_entry_t entry;
+    dir_slot_t where;
+    int found = findEntry(parent, filename, ext, &entry, &where);
+    if (!found && (flags & O_CREAT))
+    {
+        file_t file;
+        stringcopy(filename, (char *)file.entry.filename, 8);
+        stringcopy(ext, (char *)file.entry.extension, 3);
+
+        if (createFile(&file, parent) < 0)
+            return -1;
+
+        found = findEntry(parent, filename, ext, &entry, &where);
+    }
+
+    if (!found || entry.attributes & FILE_ATTRIBUTE_DIRECTORY)
+        return -1;
+
+    int16 openFile = acquireOpenFile(&where, &entry);
+    if (openFile < 0)
+        return -1;
+
+    fds[fd].inUse = 1;
+    fds[fd].openFile = openFile;
+    fds[fd].position = 0;
+
+    return fd;
+}
+
+// open() for a path like "/a/b/c.txt"
+int openPath(char *path, int flags)
+{
+    directory_t parent;
+    char filename[8];
+    char ext[3];
+
+    if (resolvePath(path, &parent, filename, ext) < 0)
+        return -1;
+
+    return open(&parent, filename, ext, flags);
+}
+
+// Read up to count bytes from the current position
+// Returns how many were read, 0 at the end of the file, -1 on a bad descriptor
+int read(int fd, void *buffer, uint32 count)
+{
+    fd_t *desc = getDescriptor(fd);
+    if (desc == NULL)
+        return -1;
+
+    open_file_t *open = &openFiles[desc->openFile];
+
+    uint32 size = open->file.entry.fileSize;
+    if (desc->position >= size)
+        return 0;
+
+    if (count > size - desc->position)
+        count = size - desc->position;
+
+    uint32 done = 0;
+    while (done < count)
+    {
+        int at = windowFor(open, desc->position);
+        if (at < 0)
+            break;
+
+        uint32 chunk = open->windowSectors * 512 - at;
+        if (chunk > count - done)
+            chunk = count - done;
+
+        memcpy((uint8 *)buffer + done, &open->window[at], chunk);
+        done += chunk;
+        desc->position += chunk;
+    }
+
+    return done;
+}
+
+// Write count bytes at the current position, growing the file if it goes past the end
+// Returns how many were written (less than count if the disk filled up, a compressed file reached
+// COMPRESS_MAX_SIZE or the window before couldn't be stored), -1 on a bad descriptor
+int write(int fd, void *buffer, uint32 count)
+{
+    fd_t *desc = getDescriptor(fd);
+    if (desc == NULL)
+        return -1;
+
+    open_file_t *open = &openFiles[desc->openFile];
+
+    // Add the clusters the write will reach before copying anything
+    // A compressed file's chain is fitted to it when it is stored
+    uint16 needed = (desc->position + count + 511) / 512;
+    uint16 have = clusterCount(&open->file);
+    if (open->file.entry.attributes & FILE_ATTRIBUTE_COMPRESSED)
+    {
+        needed = 0;
+
+        // The header has room for so many groups
+        if (desc->position + count > COMPRESS_MAX_SIZE)
+            count = desc->position < COMPRESS_MAX_SIZE ? COMPRESS_MAX_SIZE - desc->position : 0;
+    }
+    if (needed > have && extendChain(fileCluster(&open->file, have - 1), needed - have, &open->file) < 0)
+    {
+        have = clusterCount(&open->file);
+        uint32 end = have * 512;
+        count = desc->position < end ? end - desc->position : 0;
+    }
+
+    uint32 done = 0;
+    while (done < count)
+    {
+        int at = windowFor(open, desc->position);
+        if (at < 0)
+            break;
+
+        uint32 chunk = open->windowSectors * 512 - at;
+        if (chunk > count - done)
+            chunk = count - done;
+
+        memcpy(&open->window[at], (uint8 *)buffer + done, chunk);
+
+        for (uint16 i = at / 512; i <= (at + chunk - 1) / 512; i++)
+            open->windowDirty |= 1 << i;
+
+        done += chunk;
+        desc->position += chunk;
+    }
+
+    if (desc->position > open->file.entry.fileSize)
+    {
+        open->file.entry.fileSize = desc->position;
+        open->sizeChanged = 1;
+    }
+
+    return done;
+}
+
+// Move the position, whence is SEEK_SET, SEEK_CUR or SEEK_END
+// Seeking past the end is allowed, a write there fills the gap with whatever the clusters held
+// Returns the new position, or -1
+int32 lseek(int fd, int32 offset, int whence)
+{
+    fd_t *desc = getDescriptor(fd);
+    if (desc == NULL)
+        return -1;
+
+    int32 base = 0;
+    if (whence == SEEK_CUR)
+        base = desc->position;
+    else if (whence == SEEK_END)
+        base = openFiles[desc->openFile].file.entry.fileSize;
+    else if (whence != SEEK_SET)
+        return -1;
+
+    if (base + offset < 0)
+        return -1;
+
+    desc->position = base + offset;
+    return desc->position;
+}
+
+// Write back what changed and let go of the open-file entry
+// Returns -1 on a bad descriptor or if what changed couldn't be written, the descriptor is closed anyway
+int close(int fd)
+{
+    fd_t *desc = getDescriptor(fd);
+    if (desc == NULL)
+        return -1;
+
+    int result = saveOpenFile(&openFiles[desc->openFile]);
+    releaseOpenFile(desc->openFile);
+
+    desc->inUse = 0;
+    return result;
+}
+
+// Verifies both copies of FAT
+// Replaces any inconsistencies with 0x0001, and if any inconsistencies, write both copies of FAT to the disk
+// Example:
+// if entry 5 of fat0 is 6 and entry 5 of fat1 is 0, rewrite both to 1.
+// If no inconsistencies, return 0, if any inconsistencies, return count of how many
+// Changes still waiting in fat0 are synced first, and only sectors changed since the last verify are compared
+int verifyFAT()
 {
-    // The FATs and directory are loaded into 0x20000, 0x21200, and 0x22400
-    // These addresses were chosen because they are far enough away from the kernel (0x01000 - 0x07000)
+    int inconsistencies = 0;
+    uint16 rewrite = 0;     // Sectors changed by a correction
 
-    // Read the first copy of the FAT (Drive 0, Cluster 1, 512 bytes * 9 clusters)
-    fat0 = (fat_t *) startAddress; // Put FAT at 0x20000
-    floppy_read(0, 1,  (void *)fat0, sizeof(fat_t));
+    syncFAT();
 
-    // Read the second copy of the FAT (Drive 0, Cluster 10, 512 bytes * 9 clusters)
-    fat1 = (fat_t *) (startAddress+sizeof(fat_t)); // Put FAT at 0x21200
-    floppy_read(0, 10, (void *)fat1, sizeof(fat_t));
+    for (uint16 sector = 0; sector < FAT_SECTORS; sector++)
+    {
+        if (!(fatUnverified & (1 << sector)))
+            continue;
 
-    // Read the root directory (Drive 0, Cluster 19, 512 bytes * 14 clusters)
-    directory->startingAddress = (uint8 *) (startAddress+(sizeof(fat_t)*2)); // Put ROOT at 0x22400
-    floppy_read(0, 19, (void *)directory->startingAddress, 512 * 14);
+        // Compare each entry of fat0 and fat1 in this sector
+        uint16 count;
+        uint16 first = fat12SectorEntries(sector, &count);
+        for (uint16 i = first; i < first + count; i++)
+        {
+            if (fat12Get(fat0, i) != fat12Get(fat1, i))
+            {
+                // Correct the inconsistency by setting both to 0x0001
+                // An entry on a sector boundary changes the sector after this one too
+                uint16 offset = i + i / 2;
+                rewrite |= (1 << (offset / 512)) | (1 << ((offset + 1) / 512));
+                fat12Put(fat0, i, 0x0001);
+                fat12Put(fat1, i, 0x0001);
+
+                inconsistencies++;
+            }
+        }
+    }
 
-    directory->entry.filename[0] = 'R';
-    directory->entry.filename[1] = 'O';
-    directory->entry.filename[2] = 'O';
-    directory->entry.filename[3] = 'T';
+    fatUnverified = 0;
+
+    // Write the corrected sectors back to both FATs
+    fatDirty |= rewrite;
+    syncFAT();
+    logCommit();
+
+    if (inconsistencies > 0)
+        buildFreeMap();
+
+    return inconsistencies; // Return the number of inconsistencies
+}
+
+
+// Load entire boot sector from disk 0 into memory from addresses 0x40000 to 0x401FF
+// 1FF = 512
+// cache_read(fsDevice, 0, 0x40000, 1);
+
+// The and return the number of clusters that the file_t *file occupies.
+// The file must be open so that its extent map is there
+uint16 clusterCount(file_t *file)
+{
+    if (file->extentsComplete)
+        return file->mappedClusters;
+
+    // Count the clusters past the extent map
+    file_extent_t *last = &file->extents[file->extentCount - 1];
+    uint16 current = last->cluster + last->length - 1;
+    uint16 count = file->mappedClusters;
+
+    while (getFatEntry(current) >= 2 && getFatEntry(current) < FAT_ENTRIES)
+    {
+        count++;
+        current = getFatEntry(current); // Get next cluster
+    }
+
+    return count;
+}
+
+/*
+* Example of clusterCount:
+* Index Entry
+* x0002 xFFFF
+* x0003 x0007
+* x0004 x0003
+* x0005 x0004
+* x0006 x0002
+* x0007 xFFFF
+* x0008 xFFFF
+*/
+
+// Defragmenter
+// Moves each fragmented file to a free run big enough for all of it, so its chain is contiguous
+// again and reads go back to one transfer per run
+// Files of a track or more start on a track boundary, a sequential read of them then costs whole
+// tracks and no extra seeks
+// A move is ordered so that a crash at any point leaves a file system with every file intact:
+//   1. the new run is taken in both FATs (until step 3 it is only leaked)
+//   2. the data is copied, a track of the new run at a time
+//   3. the directory entry is pointed at the new run
+//   4. the old chain is freed in both FATs
+// Each step is synced before the next one starts, so the cache can't reorder them
+// The pass goes through the whole directory tree, the root first and then each subdirectory in the
+// order they are found, and defragment() carries on from where the last call stopped
+// That position only lives in memory, after a reboot (or a crash) the pass starts over from the top,
+// which only redoes files that are still fragmented
+
+#define TRACK_SECTORS 18
+
+// The cluster whose data sector (33 + cluster - 2) starts a track
+#define FIRST_TRACK_CLUSTER ((TRACK_SECTORS - (33 - 2) % TRACK_SECTORS) % TRACK_SECTORS)
+
+// Most subdirectories one walk of the tree goes into
+#define DEFRAG_MAX_DIRECTORIES 64
+
+// Clusters and pieces of a chain, walked through the FAT so no extent map is needed
+void measureChain(uint16 cluster, uint16 *clusters, uint16 *pieces)
+{
+    *clusters = 0;
+    *pieces = 0;
+
+    uint16 previous = 0;
+    while (cluster >= 2 && cluster < FAT_ENTRIES && *clusters < FAT_ENTRIES)
+    {
+        if (*clusters == 0 || cluster != previous + 1)
+            (*pieces)++;
+
+        (*clusters)++;
+        previous = cluster;
+        cluster = getFatEntry(cluster);
+    }
 }
 
-void closeFile(file_t *file)
+// Call visit for every entry in use in the directory tree, "." and ".." left out
+// The root's entries come first, then those of each subdirectory in the order they were found
+// Stops as soon as visit returns non-zero
+void walkTree(int (*visit)(dir_slot_t *where, directory_entry_t *entry, void *context), void *context)
 {
-    if (file != NULL || file->isOpened == 1)
+    uint16 directories[DEFRAG_MAX_DIRECTORIES];
+    uint16 directoryCount = 0;
+    uint8 sector[512];
+    directory_entry_t *entries = (directory_entry_t *) sector;
+
+    loadDirectory(&rootIndex);
+
+    // d is -1 for the root, whose sectors follow each other, a subdirectory is a chain of clusters
+    for (int16 d = -1; d < directoryCount; d++)
     {
-        uint16 current = file->entry.startingCluster;
-        uint32 index = 0;
-        uint32 remainingSize = file->entry.fileSize;
+        uint16 cluster = d < 0 ? 0 : directories[d];
 
-        while (remainingSize > 0)
+        for (uint16 s = 0; ; s++)
         {
-            // Write file contents to storage
-            uint32 sectorSize = remainingSize > 512 ? 512 : remainingSize;
-            floppy_write(0, 33 + (current - 2), (void *)(file->startingAddress + index), 1);
-            index += sectorSize; // Offset by a sector of data
-            remainingSize -= sectorSize; // Remove a sector of bytes
+            uint32 lba;
+            if (d < 0)
+            {
+                if (s * DIR_ENTRIES_PER_SECTOR >= rootIndex.loadedSlots)
+                    break;
+                lba = rootIndex.lba + s;
+                memcpy(sector, &rootIndex.entries[s * DIR_ENTRIES_PER_SECTOR], 512);
+            }
+            else
+            {
+                if (cluster < 2 || cluster >= FAT_ENTRIES)
+                    break;
+                lba = 33 + (cluster - 2);
+                readMetadata(lba, sector);
+                cluster = getFatEntry(cluster);
+            }
 
-            // If no more data to write and at EOF
-            if (remainingSize > 0 && fat0->entries[current] == 0xFFFF)
+            int ended = 0;
+            for (uint16 i = 0; i < DIR_ENTRIES_PER_SECTOR; i++)
             {
-                // Go through all clusters
-                for (uint16 i=2; i<2304; i++)
+                directory_entry_t *entry = &entries[i];
+
+                // Nothing past an entry that was never used is in use either
+                if (entry->filename[0] == 0x00)
                 {
-                    // If empty cluster
-                    if (fat0->entries[i] == 0x0000)
-                    {
-                        fat0->entries[current] = i;      // Save cluster addr to current cluster
-                        current = i;                     // Set free cluster as current cluster
-                        fat0->entries[current] = 0xFFFF; // Mark EOF (the free cluster now EOF)
-                        break;
-                    }
+                    ended = 1;
+                    break;
                 }
+                if (slotIsFree(entry) || entry->filename[0] == '.')
+                    continue;
+
+                if ((entry->attributes & FILE_ATTRIBUTE_DIRECTORY) && directoryCount < DEFRAG_MAX_DIRECTORIES)
+                    directories[directoryCount++] = entry->startingCluster;
+
+                dir_slot_t where;
+                where.lba = lba;
+                where.offset = i * sizeof(directory_entry_t);
+                if (visit(&where, entry, context))
+                    return;
             }
-            else {
-                current = fat0->entries[current]; // Set current as new cluster
-            }
-        }
-        file->isOpened = 0; // Make file open false (closed)
 
-    } else {
-        return; // Cannot close file, just return
+            if (ended)
+                break;
+        }
     }
 }
 
-int openFile(file_t *file)
+// Files the defragmenter leaves where they are: the kernel (the bootloader loads it from fixed
+// sectors), directories (their children's ".." entries point at them) and anything that is open,
+// whose extent maps point at the old clusters
+int isMovable(dir_slot_t *where, directory_entry_t *entry)
 {
-    if (file != NULL || file->entry.startingCluster >= 33) // Sector 33 is start of kernel executable 
+    if (entry->attributes & (FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_VOLUME | FILE_ATTRIBUTE_DIRECTORY))
+        return 0;
+
+    for (int i = 0; i < OPEN_FILE_MAX; i++)
     {
-        uint16 current = file->entry.startingCluster;
-        uint32 index = 0;
-        file->startingAddress = (uint8 *)0x30000; 
+        if (openFiles[i].refCount > 0 && openFiles[i].where.lba == where->lba &&
+            openFiles[i].where.offset == where->offset)
+            return 0;
+    }
 
-        // If not EOF, load more data
-        while (current != 0xFFFF)
-        {
-            floppy_read(0, 33 + (current - 2), (void *)(file->startingAddress + index), 512);
-            index += 512; // Offset for next sector of data
-            current = fat0->entries[current]; // Get next cluster
-        }
+    return 1;
+}
 
-        file->isOpened = 1; // Make file open true
+int measureVisit(dir_slot_t *where, directory_entry_t *entry, void *context)
+{
+    fragmentation_t *report = (fragmentation_t *) context;
+    (void) where;
+
+    if (entry->attributes & (FILE_ATTRIBUTE_VOLUME | FILE_ATTRIBUTE_DIRECTORY))
+        return 0;
+
+    uint16 clusters, pieces;
+    measureChain(entry->startingCluster, &clusters, &pieces);
+
+    report->files++;
+    report->clusters += clusters;
+    report->pieces += pieces;
+    if (pieces > 1)
+        report->fragmented++;
 
-    } else {
-        return -1;
-    }
     return 0;
 }
 
-// Creates an empty file and writes it to the floppy disk
-// You can see the effects of calling this function by viewing your OS image in a hex editor
-// Your OS image will be updated to contain the following:
-// FAT Tables changes:
-// 0x0266 - 0x0267: 0xFFFF (FAT entry) (First FAT table)
-// 0x1466 - 0x1467: 0xFFFF (FAT entry) (Second FAT table)
-// Root Directory changes:
-// 0x2620 - 0x263F: Directory entry for our new file (contains filename, extension, startingCluster, filesize, etc.)
-// File changes:
-// 0xA400 - 0xA5FF: Our file (1 sector) contains either 0's or "Hello World!\n"
-int createFile(file_t *file, directory_t *parent)
+void measureFragmentation(fragmentation_t *report)
 {
-    // IFF file and parent exists
-    if (file != NULL && parent != NULL && parent->entry.startingCluster != 0)
-    {
-        directory_entry_t *entry = (directory_entry_t *)parent->startingAddress;
-       
-        stringcopy((char *)file->entry.filename, (char *)entry->filename, 8);   // Filenames are 8 characters
-        stringcopy((char *)file->entry.extension, (char *)entry->extension, 3); // Extensions are 3 chars
+    report->files = 0;
+    report->fragmented = 0;
+    report->clusters = 0;
+    report->pieces = 0;
 
-        // Set up metadata for new file
-        entry->attributes = 0x00;   // Normal file code
-        entry->fileSize = 0;        // 0 because no data stored
+    walkTree(measureVisit, report);
+
+    // Breaks between pieces per 100 clusters, 0 when every file is in one piece
+    // An empty file has no pieces, so it doesn't count as a break
+    report->score = report->clusters > 0 && report->pieces > report->files ?
+                    (uint32) (report->pieces - report->files) * 100 / report->clusters : 0;
+}
 
-        for (uint16 i=2; i<2304; i++)
+// A free run of count clusters, on a track boundary if trackAligned and there is one
+// Returns 0 if there is no run that long anywhere
+uint16 findFreeRun(uint16 count, int trackAligned)
+{
+    if (trackAligned)
+    {
+        for (uint16 cluster = FIRST_TRACK_CLUSTER; cluster < FAT_ENTRIES; cluster += TRACK_SECTORS)
         {
-            if (fat0->entries[i] == 0x0000) // If cluster is free/empty
-            {
-                entry->startingCluster = i;     // Set starting cluster to i (free cluster)
-                fat0->entries[i] = 0xFFFF;   // Mark cluster as EOF (because no data stored yet)
-                break;
-            }
+            if (cluster >= 2 && freeRunLength(cluster, count) == count)
+                return cluster;
         }
-        file->entry = *entry; // Copy entry metadata to file data
+    }
 
-        closeFile(file);                // Close file (not in use, just created)
-    } else {
+    // First fit from the start of the disk, so files get packed towards the front
+    uint16 cluster = 2;
+    while (cluster < FAT_ENTRIES)
+    {
+        uint16 run = freeRunLength(cluster, count);
+        if (run == count)
+            return cluster;
 
-        return -1; // No file or parent directory found
+        cluster += run + 1;
     }
 
     return 0;
 }
 
-void deleteFile(file_t *file, directory_t *parent)
+// Copy a chain's data to the run starting at destination, at most a track at a time
+// Pieces are cut at destination track boundaries so every write stays on one track
+void copyChain(uint16 source, uint16 destination, uint8 *buffer)
 {
-    if (file != NULL && parent != NULL && parent->entry.startingCluster != 0)
+    while (source >= 2 && source < FAT_ENTRIES)
     {
-        uint16 current = file->entry.startingCluster;   // get cluster of file
+        uint16 run = 1;
+        while (getFatEntry(source + run - 1) == source + run)
+            run++;
 
-        // Loop thru clusters until EOF (Last cluster)
-        while (current != 0xFFFF)
+        uint16 next = getFatEntry(source + run - 1);
+
+        while (run > 0)
         {
-            uint16 next = fat0->entries[current];       // entries[cluster] has next cluster #
-            fat0->entries[current] = 0x0000;            // Make cluster empty
-            current = next;
-        }
+            uint32 lba = 33 + (destination - 2);
+            uint16 count = TRACK_SECTORS - lba % TRACK_SECTORS;
+            if (count > run)
+                count = run;
 
-        // Sync FAT1 with FAT0
-        for (uint16 i=0; i<2304; i++)
-            fat1->entries[i] = fat0->entries[i];
+            cache_read(fsDevice, 33 + (source - 2), buffer, count);
+            cache_write(fsDevice, lba, buffer, count);
 
-        // Updating parent directory by removing directory entry as per instruction
-        directory_entry_t *entry = (directory_entry_t *)parent->startingAddress;
-        while (entry->filename[0] != 0)
-        {
-            // Check if filename and extension match
-            // Extension is needed because test.py != test.txt, they're different files
-            if (stringcompare((char *)entry->filename, (char *)file->entry.filename, 8) && stringcompare((char *)entry->extension, (char *)file->entry.extension, 3))
-            {
-                entry->filename[0] = 0; // Setting name as 0
-                break;
-            }
-            entry++;
+            source += count;
+            destination += count;
+            run -= count;
         }
 
-    } else {
-        return; // File or parent directory not found
+        source = next;
     }
 }
 
-// Returns a byte from a file that is currently loaded into memory
-// This does NOT modify the floppy disk
-// This function requires the file to have been loaded into memory with floppy_read()
-uint8 readByte(file_t *file, uint32 index)
+// Move the chain starting at clusterA, and its data, to the free run of as many clusters at clusterB
+// This is steps 1 and 2 of a move: the run is taken in both FATs, then the data is copied a track
+// at a time, each synced before the next
+// The old chain is left as it is, the caller points its owner at clusterB and only then frees it
+// Returns -1 if the run at clusterB isn't free or there is no buffer for the copy
+int moveCluster(uint16 clusterA, uint16 clusterB)
 {
-    if (file != NULL && file->isOpened)
-        return *((uint8 *)(file->startingAddress + index));
+    uint16 clusters, pieces;
+    measureChain(clusterA, &clusters, &pieces);
+    if (clusters == 0 || clusterB < 2 || freeRunLength(clusterB, clusters) < clusters)
+        return -1;
+
+    uint8 *buffer = allocateBuffer(TRACK_SECTORS * 512);
+    if (buffer == NULL)
+        return -1;
+
+    // 1. Take the new run
+    takeRun(clusterB, clusters);
+    syncFAT();
+    logCommit();
+    cache_sync();
+
+    // 2. Copy the data over
+    copyChain(clusterA, clusterB, buffer);
+    cache_sync();
+
+    freeBuffer(buffer, TRACK_SECTORS * 512);
     return 0;
 }
 
-// Writes a byte to a file that is currently loaded into memory
-// This does NOT modify the floppy disk
-// To write this to the floppy disk, we have to call floppy_write()
-int writeByte(file_t *file, uint8 byte, uint32 index)
+// Move the file whose entry is at where to one contiguous run
+// Returns 1 if it was moved, 0 if it didn't need to be, -1 if it couldn't be (no free run big
+// enough, or no memory for the copy)
+int moveChain(dir_slot_t *where, directory_entry_t *entry)
 {
-    if (!file->isOpened)
+    uint16 clusters, pieces;
+    measureChain(entry->startingCluster, &clusters, &pieces);
+    if (pieces <= 1)
+        return 0;
+
+    uint16 destination = findFreeRun(clusters, clusters >= TRACK_SECTORS);
+    if (destination == 0)
+        return -1;
+
+    // 1 and 2
+    uint16 old = entry->startingCluster;
+    if (moveCluster(old, destination) < 0)
+        return -1;
+
+    // 3. Point the file at it
+    entry->startingCluster = destination;
+    storeEntry(where, entry);
+    logCommit();
+    cache_sync();
+
+    // 4. Give back the old chain
+    while (old >= 2 && old < FAT_ENTRIES)
     {
-        return -1; //File not opened
+        uint16 next = getFatEntry(old);
+        freeCluster(old);
+        old = next;
     }
+    syncFAT();
+    logCommit();
+    cache_sync();
 
-    *((uint8 *)(file->startingAddress + index)) = byte; // Add bye to index
-    file->entry.fileSize++;                              // Update file size
-
-    return 0;
+    return 1;
 }
 
-int findFile(char *filename, char* ext, directory_t directory, directory_entry_t *foundEntry)
+typedef struct
+{
+    uint16 position;            // Entries of the tree gone past in this walk
+    uint16 looked;              // Movable files looked at in this call
+    uint16 maxFiles;
+    int stopped;                // Set if the walk stopped before the end of the tree
+    defrag_report_t *report;
+} defrag_walk_t;
+
+int defragVisit(dir_slot_t *where, directory_entry_t *entry, void *context)
 {
-	directory_entry_t *entry = (directory_entry_t *)directory.startingAddress;
+    defrag_walk_t *walk = (defrag_walk_t *) context;
+
+    if (walk->looked == walk->maxFiles)
+    {
+        walk->stopped = 1;
+        return 1;
+    }
+
+    // Entries the last calls already went past
+    walk->position++;
+    if (walk->position <= defragCursor)
+        return 0;
+    defragCursor = walk->position;
 
-	while(entry->filename[0] != 0)
-	{
-		int fileExists = stringcompare((char *)entry->filename, filename, 8) && stringcompare((char *)entry->extension, ext, 3);
-		
-		if(fileExists)
-		{
-			*foundEntry = *entry;
-			return 1;
-		}
+    if (!isMovable(where, entry))
+        return 0;
 
-		entry++;
-	}
+    int result = moveChain(where, entry);
+    if (result > 0)
+        walk->report->moved++;
+    else if (result < 0)
+        walk->report->skipped++;
 
-	return 0;
+    walk->looked++;
+    return 0;
 }
 
-// Renames the file in the parent directory entry with the new filename and extension.
-// Once the parent directory entry is modified, the changes must be written to the floppy disk using floppy_write()
-void renameFile(file_t *file, directory_t *parent, char *newFilename, char *newExtension)
+// Defragment up to maxFiles files from where the last call stopped
+// Fills in report (fragmentation before and after this batch and what was done)
+// Returns 1 once the whole directory tree has been gone through, the next call starts over
+int defragment(uint16 maxFiles, defrag_report_t *report)
 {
-    // Pre check
-    if (file == NULL || parent == NULL || parent->entry.startingCluster == 0)
-    {
-        return; // Invalid file or parent directory
-    }
+    measureFragmentation(&report->before);
+    report->moved = 0;
+    report->skipped = 0;
 
-    directory_entry_t *entry = (directory_entry_t *)parent->startingAddress;
+    defrag_walk_t walk;
+    walk.position = 0;
+    walk.looked = 0;
+    walk.maxFiles = maxFiles;
+    walk.stopped = 0;
+    walk.report = report;
 
-    // Search for the file in the parent directory
-    while (entry->filename[0] != 0)
-    {
-        if (stringcompare((char *)entry->filename, (char *)file->entry.filename, 8) &&
-            stringcompare((char *)entry->extension, (char *)file->entry.extension, 3))
-        {
-            // Update filename and extension
-            stringcopy((char *)entry->filename, newFilename, 8);
-            stringcopy((char *)entry->extension, newExtension, 3);
+    walkTree(defragVisit, &walk);
 
-            // Dynamically determine where to write the directory back to floppy disk
-            uint16 numSectors = (uint16)((parent->entry.fileSize + 511) / 512); // Total sectors (fileSize rounded up)
+    measureFragmentation(&report->after);
 
-            // Write the updated directory back to disk
-            floppy_write(0, 33 + (parent->entry.startingCluster - 2), parent->startingAddress, numSectors);
+    if (walk.stopped)
+        return 0;
 
-            // Update the file's metadata in memory
-            stringcopy((char *)file->entry.filename, newFilename, 8);
-            stringcopy((char *)file->entry.extension, newExtension, 3);
+    defragCursor = 0;
+    return 1;
+}
 
-            return; // File successfully renamed
-        }
-        entry++;
-    }
+// Consistency checker
+// One pass decodes the FAT into an array, one walk per file marks the clusters it owns in a bitmap
+// and stops at the first cluster somebody already owns, and one pass over the FAT finds the
+// clusters in use that nobody owns
+// Every cluster is looked at a fixed number of times, however many files there are and however
+// long their chains are
+// Problems found, and what repair mode does about them:
+//   cross-linked - the chain runs into a cluster an earlier file (or its own chain) owns,
+//                  the chain is cut before that cluster
+//   truncated    - the chain reaches a free, reserved or out-of-range entry instead of an end
+//                  marker, the chain is ended at its last good cluster (a file left with no
+//                  cluster at all gets a new empty one)
+//   bad size     - the size needs more or fewer clusters than the chain has, a size that is too
+//                  big is cut down to the chain, clusters past the size are freed
+//   lost         - the FAT says the cluster is in use but no file owns it, it is freed
+
+#define FSCK_MAX_DIRECTORIES 64
+
+#define isOwned(owned, cluster) ((owned)[(cluster) / 32] & (1 << ((cluster) % 32)))
+#define setOwned(owned, cluster) ((owned)[(cluster) / 32] |= 1 << ((cluster) % 32))
+
+// Change an entry in both the decoded array and fat0
+void repairEntry(uint16 *next, uint16 cluster, uint16 value)
+{
+    next[cluster] = value;
+    setFatEntry(cluster, value);
 }
 
-// Verifies both copies of FAT
-// Replaces any inconsistencies with 0x0001, and if any inconsistencies, write both copies of FAT to the disk
-// Example:
-// if fat0->entries[5] = 6 and fat1->entries[5] = 0, rewrite both to fat0->entries[5] = fat1->entries[5] = 1.
-// If no inconsistencies, return 0, if any inconsistencies, return count of how many
-int verifyFAT()
+// Check one directory entry's chain, marking its clusters as owned
+// Returns the first cluster of a subdirectory whose clusters this walk took, so its entries get
+// checked too, 0 otherwise
+uint16 checkChain(directory_entry_t *entry, dir_slot_t *where, uint16 *next, uint32 *owned, int repair,
+                  fsck_report_t *report)
 {
-    int inconsistencies = 0;
+    int isDirectory = entry->attributes & FILE_ATTRIBUTE_DIRECTORY;
+    uint16 needed = entry->fileSize > 0 ? (entry->fileSize + 511) / 512 : 1;
+
+    // Other systems give an empty file no cluster at all, that is as valid as our one cluster
+    if (!isDirectory && entry->fileSize == 0 && entry->startingCluster == 0)
+        return 0;
+
+    uint16 cluster = entry->startingCluster;
+    uint16 previous = 0;
+    uint16 count = 0;
+    uint16 lastNeeded = 0;  // Cluster number needed of the chain, where a chain that is too long gets cut
+    int changed = 0;
 
-    // Compare each entry of fat0 and fat1
-    for (uint16 i = 0; i < 2304; i++) // 2304 entries in each FAT
+    while (cluster != FAT_EOF)
     {
-        if (fat0->entries[i] != fat1->entries[i])
+        if (cluster < 2 || cluster >= FAT_ENTRIES)
         {
-            // Correct the inconsistency by setting both to 0x0001
-            fat0->entries[i] = 0x0001;
-            fat1->entries[i] = 0x0001;
+            report->truncated++;
+            break;
+        }
 
-            inconsistencies++;
+        if (isOwned(owned, cluster))
+        {
+            report->crossLinked++;
+            break;
         }
+
+        setOwned(owned, cluster);
+        count++;
+        if (count == needed)
+            lastNeeded = cluster;
+
+        previous = cluster;
+        cluster = next[cluster];
     }
 
-    // If inconsistencies were found, write both FATs back to disk
-    if (inconsistencies > 0)
+    // The walk stopped early, end the chain where it stopped
+    if (cluster != FAT_EOF && repair)
     {
-        // Similar to floppy_read command in init_fs
-        floppy_write(0, 1, (void *)fat0, sizeof(fat_t));  // Write first FAT back to disk
-        floppy_write(0, 10, (void *)fat1, sizeof(fat_t)); // Write second FAT back to disk
+        if (previous != 0)
+        {
+            repairEntry(next, previous, FAT_EOF);
+        }
+        else
+        {
+            uint16 fresh = allocateCluster();
+            if (fresh != 0)
+            {
+                setOwned(owned, fresh);
+                next[fresh] = FAT_EOF;
+                count = 1;
+                lastNeeded = fresh;
+            }
+
+            entry->startingCluster = fresh;
+            entry->fileSize = 0;
+            needed = 1;
+            changed = 1;
+        }
+
+        report->repaired++;
     }
 
-    return inconsistencies; // Return the number of inconsistencies
-}
+    if (!isDirectory && count != needed)
+    {
+        report->badSize++;
 
-// Load entire boot sector from disk 0 into memory from addresses 0x40000 to 0x401FF
-// 1FF = 512
-// floppy_read(0, 0, 0x40000, 512);
+        if (repair && count < needed)
+        {
+            entry->fileSize = count * 512;
+            changed = 1;
+            report->repaired++;
+        }
+        else if (repair && lastNeeded != 0)
+        {
+            // Free everything after the last cluster the size needs
+            uint16 tail = next[lastNeeded];
+            repairEntry(next, lastNeeded, FAT_EOF);
 
-// The and return the number of clusters that the file_t *file occupies.
-uint16 clusterCount(file_t *file)
-{
-    uint16 current = file->entry.startingCluster;
-    uint16 count = 1;   // Counting first cluster
+            while (tail >= 2 && tail < FAT_ENTRIES)
+            {
+                uint16 after = next[tail];
+                owned[tail / 32] &= ~(1 << (tail % 32));
+                next[tail] = 0x0000;
+                freeCluster(tail);
+                tail = after;
+            }
 
-    // If not EOF, load more data
-    while (current != 0xFFFF)
-    {
-        count++;
-        current = fat0->entries[current]; // Get next cluster
+            report->repaired++;
+        }
     }
 
-    return count;
-}
+    if (changed)
+        storeEntry(where, entry);
 
-/*
-* Example of clusterCount:
-* Index Entry
-* x0002 xFFFF
-* x0003 x0007
-* x0004 x0003
-* x0005 x0004
-* x0006 x0002
-* x0007 xFFFF
-* x0008 xFFFF
-*/
+    return isDirectory && count > 0 ? entry->startingCluster : 0;
+}
 
-// Move clusterA and its data to clusterB in the FAT
-int moveCluster(uint16 clusterA, uint16 clusterB)
+// Check the whole volume, and fix what is wrong if repair is non-zero
+// Repair mode needs every file to be closed
+// Returns how many problems were found, -1 if the check couldn't run
+int checkFilesystem(int repair, fsck_report_t *report)
 {
-    // Check if clusterB is currently occupied, if so return -1
-    if (fat->entries[clusterB] != 0x0000)
+    report->files = 0;
+    report->fatMismatches = 0;
+    report->crossLinked = 0;
+    report->truncated = 0;
+    report->badSize = 0;
+    report->lostClusters = 0;
+    report->repaired = 0;
+
+    if (repair)
     {
-        return -1;
+        for (int i = 0; i < OPEN_FILE_MAX; i++)
+        {
+            if (openFiles[i].refCount > 0)
+                return -1;
+        }
     }
 
-    uint16 buffer[512]; // Buffer to save data from cluster
+    uint16 *next = allocateBuffer(FAT_ENTRIES * sizeof(uint16));
+    if (next == NULL)
+        return -1;
 
-    // Grab data inside sector at Cluster A, 
-    floppy_read(0, 33 + (clusterA - 2), (void *)buffer, 512);
-    // Move it to Cluster B
-    floppy_write(0, 33 + (clusterB - 2), (void *)buffer, 512);
+    // Changes that haven't been written yet are not inconsistencies
+    syncFAT();
 
-    // Link Cluster B
-    fat->entries[clusterB] = fat->entries[clusterA];
-    // Now ClusterB points to clusterA's next cluster
+    // The two copies, repair mode lets verifyFAT() mark every difference as used
+    if (repair)
+    {
+        fatUnverified = (1 << FAT_SECTORS) - 1;
+        report->fatMismatches = verifyFAT();
+    }
+    else
+    {
+        for (uint16 i = 0; i < FAT12_TABLE_ENTRIES; i++)
+        {
+            if (fat12Get(fat0, i) != fat12Get(fat1, i))
+                report->fatMismatches++;
+        }
+    }
 
-    // Clear Cluster A
-    fat0->entries[clusterA] = 0x0000; // Mark clusterA as free
+    fat12Decode(fat0, 0, FAT_ENTRIES, next);
 
-    // Save/Update FATs
-    // Sync FAT1 with FAT0
-    for (uint16 i=0; i<2304; i++)
-        fat1->entries[i] = fat0->entries[i];
-    return 0;
-}
+    uint32 owned[FREE_MAP_WORDS];
+    for (uint16 i = 0; i < FREE_MAP_WORDS; i++)
+        owned[i] = 0;
 
-int moveCluster(uint16 clusterA, uint16 clusterB)
-{
-    // Check if clusterB is currently occupied, if so return -1
-    if (fat0->entries[clusterB] != 0x0000)
-    {
-        return -1; // ClusterB is not free
-    }
+    setOwned(owned, 0);
+    setOwned(owned, 1);
 
-    // Initialize variables for reading and writing
-    uint8 buffer[512]; // Buffer to hold data for one sector
-    uint16 current = clusterA; // Start from clusterA
-    uint32 index = 0; // Index for the buffer
+    // Subdirectories found on the way, checked after the root
+    uint16 directories[FSCK_MAX_DIRECTORIES];
+    uint16 directoryCount = 0;
+    int complete = 1;
 
-    // Read data from clusterA
-    while (current != 0xFFFF)
+    loadDirectory(&rootIndex);
+    for (int16 slot = 0; slot < rootIndex.loadedSlots; slot++)
     {
-        // Read the data from the current cluster into the buffer
-        floppy_read(0, 33 + (current - 2), buffer, 512);
-
-        // Write the data to clusterB
-        floppy_write(0, 33 + (clusterB - 2), buffer, 512);
+        directory_entry_t *entry = &rootIndex.entries[slot];
+        if (slotIsFree(entry) || entry->attributes & FILE_ATTRIBUTE_VOLUME)
+            continue;
+
+        report->files++;
+        dir_slot_t where = rootSlot(slot);
+        uint16 directory = checkChain(entry, &where, next, owned, repair, report);
+        if (directory != 0 && directoryCount < FSCK_MAX_DIRECTORIES)
+            directories[directoryCount++] = directory;
+        else if (directory != 0)
+            complete = 0;
+    }
 
-        // Move to the next cluster in the chain
-        current = fat0->entries[current];
+    for (uint16 d = 0; d < directoryCount; d++)
+    {
+        uint8 sector[512];
+        directory_entry_t *entries = (directory_entry_t *) sector;
 
-        // If we have more clusters to move, we need to find the next free cluster
-        if (current != 0xFFFF)
+        for (uint16 cluster = directories[d]; cluster >= 2 && cluster < FAT_ENTRIES; cluster = next[cluster])
         {
-            // Find the next free cluster for clusterB
-            uint16 nextFreeCluster = 0xFFFF; // Initialize to indicate no free cluster found
-            for (uint16 i = 2; i < 2304; i++)
+            dir_slot_t where;
+            where.lba = 33 + (cluster - 2);
+            readMetadata(where.lba, sector);
+
+            for (uint16 i = 0; i < DIR_ENTRIES_PER_SECTOR; i++)
             {
-                if (fat0->entries[i] == 0x0000) // If cluster is free
-                {
-                    nextFreeCluster = i; // Found a free cluster
-                    break;
-                }
+                // "." and ".." belong to chains that are checked already
+                if (slotIsFree(&entries[i]) || entries[i].filename[0] == '.' ||
+                    entries[i].attributes & FILE_ATTRIBUTE_VOLUME)
+                    continue;
+
+                report->files++;
+                where.offset = i * sizeof(directory_entry_t);
+                uint16 directory = checkChain(&entries[i], &where, next, owned, repair, report);
+                if (directory != 0 && directoryCount < FSCK_MAX_DIRECTORIES)
+                    directories[directoryCount++] = directory;
+                else if (directory != 0)
+                    complete = 0;
             }
+        }
+    }
 
-            if (nextFreeCluster == 0xFFFF)
+    // Used clusters nobody owns, clusters marked bad are neither
+    // If there were too many directories to check them all, their files would look lost, so nothing is freed
+    for (uint16 cluster = 2; cluster < FAT_ENTRIES && complete; cluster++)
+    {
+        if (next[cluster] != 0x0000 && next[cluster] != FAT12_BAD && !isOwned(owned, cluster))
+        {
+            report->lostClusters++;
+
+            if (repair)
             {
-                return -1; // No free cluster available to continue moving
+                freeCluster(cluster);
+                report->repaired++;
             }
-
-            // Update the FAT to link the current cluster to the next free cluster
-            fat0->entries[clusterB] = nextFreeCluster; // Link clusterB to the next free cluster
-            clusterB = nextFreeCluster; // Move to the next free cluster for the next iteration
         }
     }
 
-    // Clear the original clusterA in the FAT
-    fat0->entries[clusterA] = 0x0000; // Mark clusterA as free
+    freeBuffer(next, FAT_ENTRIES * sizeof(uint16));
 
-    // Sync FAT1 with FAT0
-    for (uint16 i = 0; i < 2304; i++)
+    if (repair)
     {
-        fat1->entries[i] = fat0->entries[i];
+        syncFAT();
+        logCommit();
+        buildFreeMap();
     }
 
-    return 0; // Success
+    return report->fatMismatches + report->crossLinked + report->truncated + report->badSize + report->lostClusters;
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 #include "./dma.h"
 #include "./irq.h"
 #include "./io.h"
+#include "./fdc.h"
+#include "./multitasking.h"
 // standard IRQ number for floppy controllers
 static const int floppy_irq = 6;
 
@@ -118,14 +120,14 @@ unsigned char floppy_read_data();
 void lba_2_chs_f(int sectors_per_track, uint32 lba, uint16* cyl, uint16* head, uint16* sector)
 {
     *cyl    = lba / (2 * sectors_per_track);
-    *head   = ((lba % (2 * sectors_per_track)) / 18);
+    *head   = ((lba % (2 * sectors_per_track)) / sectors_per_track);
     *sector = ((lba % (2 * sectors_per_track)) % sectors_per_track + 1);
 
 }
 
 void lba_2_chs(uint32 lba, uint16* cyl, uint16* head, uint16* sector)
 {
-    lba_2_chs_f(18, lba, cyl, head, sector);
+    lba_2_chs_f(FLOPPY_SECTORS_PER_TRACK, lba, cyl, head, sector);
 }
 
 
@@ -199,9 +201,65 @@ void floppy_reset(int firstTime);
 void floppy_recalibrate(uint8  drive);
 void floppy_sense_interrupt(uint8 *st0, uint8 *cyl);
 void specify();
-void drive_select(int drive);
-void floppy_rw_command(int drive, int head, int cyl, int sect, int EOT, uint8 *st0, uint8 *st1, uint8 *st2,
-                       int *headResult, int *cylResult, int *sectResult, int command);
+int drive_select(int drive);
+void floppy_rw_command(int drive, int head, int cyl, int sect, int EOT, int command);
+void floppy_rw_result(uint8 *st0, uint8 *st1, uint8 *st2, int *headResult, int *cylResult, int *sectResult);
+int floppy_rw_status(uint8 st0, uint8 st1, uint8 st2);
+int floppy_transfer(int drive, uint32 lba, uint8 *address, uint16 count, int type);
+void floppy_irq_handler(regs *r);
+void floppy_timer_handler(regs *r);
+
+
+/*
+ * Drive state tracking
+ *
+ * Everything the controller and drives were last told is remembered here so that
+ * drive_select() and specify() only talk to the controller when something changes.
+ * Motors stay on between commands and are switched off by the timer once the drives
+ * have been idle for FLOPPY_MOTOR_OFF_TICKS.
+ */
+
+// IRQ0 is left at the BIOS rate of about 18.2 ticks per second
+#define FLOPPY_SPINUP_TICKS 6       // ~330ms for a motor to get up to speed
+#define FLOPPY_MOTOR_OFF_TICKS 36   // ~2s of idling before the motors are switched off
+
+typedef struct
+{
+    int rateSet;            // Non-zero once the data rate went to the CCR
+    int specified;          // Non-zero once the SRT/HLT/HUT below went to the controller
+    uint8 SRT;
+    uint8 HLT;
+    uint8 HUT;
+    int selected;           // Drive selected in the DOR, -1 if unknown
+    uint8 motors;           // Motor bits of the DOR (bits 4-7) that are on
+    uint32 motorReady;      // Tick at which the last motor switched on is up to speed
+    uint32 lastUse;         // Tick at which the controller last finished something
+    int cylinder[4];        // Cylinder each drive's heads sit over, -1 if unknown
+} floppy_drive_state_t;
+
+static floppy_drive_state_t driveState;
+static volatile uint32 floppyTicks;
+
+// Forget everything, used at install time and after a controller reset
+static void floppy_forget_state(){
+    driveState.rateSet = 0;
+    driveState.specified = 0;
+    driveState.selected = -1;
+    driveState.motors = 0;
+    driveState.motorReady = 0;
+    driveState.lastUse = floppyTicks;
+
+    for(int i = 0; i < 4; i++)
+        driveState.cylinder[i] = -1;
+}
+
+// DMA/IRQ enabled, controller out of reset, the tracked motors and selected drive
+static uint8 floppy_dor(){
+    uint8 DOR = 0x0C | driveState.motors;
+    if(driveState.selected >= 0)
+        DOR |= driveState.selected;
+    return DOR;
+}
 
 
 // Floppy Commands
@@ -229,15 +287,29 @@ int floppy_init(){
 /*
  * https://wiki.osdev.org/Floppy_Disk_Controller#Drive_Selection
  */
-void drive_select(int drive){
-    outb(FLOPPY_CONFIGURATION_CONTROL_REGISTER, 0); // This is usually correct, even tho it changes if not using 1.44Mb drive.
+// Returns non-zero while the drive's motor is still spinning up
+int drive_select(int drive){
+    if(!driveState.rateSet){
+        outb(FLOPPY_CONFIGURATION_CONTROL_REGISTER, 0); // This is usually correct, even tho it changes if not using 1.44Mb drive.
+        driveState.rateSet = 1;
+    }
+
     specify();
 
-    // Select drive in DOR and turn on its motor
-    uint8 DOR = inb(FLOPPY_DIGITAL_OUTPUT_REGISTER);
-    // turn off all motors | select drive | turn on drive's motor
-    DOR = (DOR & 0xC) | (drive | (1 << (4 + drive)));
-    outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, DOR);
+    // Select drive in DOR and turn on its motor, other motors are left to the idle timer
+    uint8 motor = 1 << (4 + drive);
+    int spinUp = !(driveState.motors & motor);
+
+    if(driveState.selected != drive || spinUp){
+        driveState.motors |= motor;
+        driveState.selected = drive;
+        outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, floppy_dor());
+    }
+
+    if(spinUp)
+        driveState.motorReady = floppyTicks + FLOPPY_SPINUP_TICKS;
+
+    return (int)(driveState.motorReady - floppyTicks) > 0;
 }
 
 /*
@@ -254,10 +326,18 @@ void specify(){
     int HLT = 5;
     int HUT = 0;
 
+    // The controller keeps these until it is reset
+    if(driveState.specified && driveState.SRT == SRT && driveState.HLT == HLT && driveState.HUT == HUT)
+        return;
+
     floppy_write_cmd(FLOPPY_SPECIFY);
     floppy_write_cmd(SRT << 4 | HUT);
     floppy_write_cmd(HLT << 1 | 0);
 
+    driveState.specified = 1;
+    driveState.SRT = SRT;
+    driveState.HLT = HLT;
+    driveState.HUT = HUT;
 
 }
 
@@ -284,16 +364,16 @@ void floppy_lock(){
  * https://wiki.osdev.org/Floppy_Disk_Controller#Recalibrate
  */
 void floppy_recalibrate(uint8 drive){
-    floppy_write_cmd(FLOPPY_RECALIBRATE);
-    floppy_write_cmd(drive);
+    // Already known to be over cylinder 0
+    if(driveState.cylinder[drive] == 0)
+        return;
 
-    irq_wait(floppy_irq);
-    uint8 st0 = 0;
-    uint8 cyl = 0;
-    floppy_sense_interrupt(&st0, &cyl);
+    block_request_t request;
+    request.type = BLOCK_REQUEST_RECALIBRATE;
+    request.drive = drive;
 
-    if(!(st0 & 0x20))
-        floppy_recalibrate(drive);
+    floppy_submit(&request);
+    floppy_wait(&request);
 }
 
 
@@ -319,138 +399,581 @@ void floppy_sense_interrupt(uint8 *st0, uint8 *cyl){
  * https://wiki.osdev.org/Floppy_Disk_Controller#Controller_Reset
  */
 void floppy_reset(int firstTime){
-    uint8 DOR = inb(FLOPPY_DIGITAL_OUTPUT_REGISTER);
-    outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, 0);
-    //sleep(10);
-    outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, DOR & 0x8);
     if(!firstTime){ // check if IRQs were enabled
-        irq_wait(floppy_irq);
+        // Let the IRQ6 handler see the reset through so the caller can sleep
+        block_request_t request;
+        request.type = BLOCK_REQUEST_RESET;
+        request.drive = 0;
+
+        floppy_submit(&request);
+        floppy_wait(&request);
+        return;
     }
+
+    outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, 0);
+    //sleep(10);
+    floppy_forget_state();
+    outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, floppy_dor());
 }
 
 
 
 /*
- * https://wiki.osdev.org/Floppy_Disk_Controller#Read.2FWrite
+ * Decode the ST0-ST2 result bytes of a read/write command
+ * Returns 0 on success, 1 for errors worth retrying and 2 when the disk is write protected
  */
+int floppy_rw_status(uint8 st0, uint8 st1, uint8 st2){
+    int error = 0;
+
+    if(st0 >> 6 == 2){error = 1;}
+    if(st1 & 0x80) {error = 1;}
+    if(st0 & 0x08) {error = 1;}
+    if(st0 >> 6 == 3){error = 1;}
+    if(st1 & 0x20) {error = 1;}
+    if(st1 & 0x10) {error = 1;}
+    if(st1 & 0x04) {error = 1;}
+    if((st1|st2) & 0x01) {error = 1;}
+    if(st2 & 0x40) {error = 1;}
+    if(st2 & 0x20) {error = 1;}
+    if(st2 & 0x10) {error = 1;}
+    if(st2 & 0x04) {error = 1;}
+    if(st2 & 0x02) {error = 1;}
+    if(st1 & 0x02) {error = 2;}
+
+    return error;
+}
 
-int floppy_write(int drive, uint32 lba, void* address, uint16 count){
-    initFloppyDMA((uint32) address, count);
+/*
+ * Asynchronous request queue
+ *
+ * Requests are queued by floppy_submit() and the controller works on one command at a
+ * time. The command is written to the controller when a request is dispatched, and
+ * everything after that happens in the IRQ6 handler: it reads the result, retries or
+ * moves on, and once a request is finished wakes the process sleeping in floppy_wait()
+ * and dispatches the next one.
+ *
+ * The scheduler decides which pending request is dispatched next:
+ *  - FIFO runs requests in submission order, one whole request after another
+ *  - C-SCAN picks the request whose (cylinder, head) is the first at or past the current
+ *    head position, and wraps back to the lowest one once nothing is left ahead, so the
+ *    heads always sweep in one direction. A request spanning several cylinders goes back
+ *    into the pending set after each cylinder.
+ * In both modes pending requests for the sectors right after the dispatched one are merged
+ * into the same command (through the bounce buffer) as long as they stay on its cylinder.
+ *
+ * A transfer goes straight to the request's memory whenever ISA DMA can reach it. It is
+ * cut short at a 64KB boundary, and only memory DMA cannot use at all (above 16MB or a
+ * sector straddling a boundary) goes through the bounce buffer from the DMA pool.
+ */
 
-    drive_select(drive);
+static block_request_t *queueHead;      // Oldest pending request
+static block_request_t *queueTail;      // Newest pending request
+static block_request_t *activeRequest;  // Request that owns the controller, merged requests hang off it
+static int spinningUp;                  // Set while the active request waits for its motor
+
+// The command the controller is running
+static uint32 transferLba;
+static uint8 *transferAddress;
+static uint16 transferCount;
+static int transferMerged;
+static int transferBounced;
+static uint8 *bounceBuffer;             // One cylinder from the DMA pool
+
+static floppy_scheduler_t scheduler;
+static int plugged;                     // Set while floppy_plug() holds requests back
+static uint16 headPosition;             // cylinder * 2 + head of the last command
+static floppy_sched_stats_t schedStats;
+static blockdev_t floppyDevice;
+
+// Interrupts must be disabled around anything that touches the queue
+static uint32 floppy_lock_irq(){
+    uint32 eflags;
+    asm volatile("pushfl; pop %0; cli" : "=r"(eflags));
+    return eflags;
+}
+
+static void floppy_unlock_irq(uint32 eflags){
+    if(eflags & 0x200)
+        asm volatile("sti");
+}
 
+// Elevator key of the next sector a request needs
+static uint16 floppy_position(block_request_t *request){
     uint16 cyl;
     uint16 head;
     uint16 sector;
-    lba_2_chs(lba, &cyl, &head, &sector);
+    lba_2_chs(request->lba, &cyl, &head, &sector);
 
-    int EOT = 19;
+    return cyl * FLOPPY_HEADS + head;
+}
 
-    uint8 st0;
-    uint8 st1;
-    uint8 st2;
-    int cylOut;
-    int headOut;
-    int sectOut;
+// Sectors left on the cylinder of lba, counting both heads from the one lba is on
+static uint16 floppy_cylinder_left(uint32 lba){
+    return FLOPPY_HEADS * FLOPPY_SECTORS_PER_TRACK - lba % (FLOPPY_HEADS * FLOPPY_SECTORS_PER_TRACK);
+}
 
+static void floppy_queue_append(block_request_t *request){
+    request->next = 0;
+
+    if(queueTail)
+        queueTail->next = request;
+    else
+        queueHead = request;
+    queueTail = request;
+}
 
-    for(int i = 0; i < 20; i++){
+static void floppy_queue_remove(block_request_t *request){
+    block_request_t *prev = 0;
+    block_request_t *current = queueHead;
 
+    while(current && current != request){
+        prev = current;
+        current = current->next;
+    }
+
+    if(!current)
+        return;
+
+    if(prev)
+        prev->next = request->next;
+    else
+        queueHead = request->next;
+
+    if(queueTail == request)
+        queueTail = prev;
+
+    request->next = 0;
+}
+
+// Pick the pending request that should go to the controller next
+static block_request_t *floppy_pick(){
+    block_request_t *request;
+
+    // Resets and recalibrations are never reordered
+    for(request = queueHead; request; request = request->next){
+        if(request->type != BLOCK_REQUEST_READ && request->type != BLOCK_REQUEST_WRITE)
+            return request;
+    }
+
+    if(scheduler == FLOPPY_SCHED_FIFO)
+        return queueHead;
+
+    block_request_t *ahead = 0;
+    block_request_t *lowest = 0;
+
+    for(request = queueHead; request; request = request->next){
+        uint16 position = floppy_position(request);
+
+        if(position >= headPosition && (!ahead || position < floppy_position(ahead)))
+            ahead = request;
+        if(!lowest || position < floppy_position(lowest))
+            lowest = request;
+    }
+
+    return ahead ? ahead : lowest;
+}
+
+// Write the command for the current transfer, which never leaves its cylinder
+// The MT bit lets the controller carry on from head 0 into head 1, and the DMA
+// terminal count (programmed from the real byte length) ends the command
+static void floppy_start_transfer(){
+    uint16 cyl;
+    uint16 head;
+    uint16 sector;
+    lba_2_chs(transferLba, &cyl, &head, &sector);
+
+    // The DMA controller expects the byte count minus one
+    initFloppyDMA((uint32) transferAddress, transferCount * FLOPPY_SECTOR_SIZE - 1);
+
+    if(activeRequest->type == BLOCK_REQUEST_WRITE){
         prepare_for_floppyDMA_write();
+        floppy_rw_command(activeRequest->drive, head, cyl, sector, FLOPPY_SECTORS_PER_TRACK, FLOPPY_WRITE_DATA);
+    }
+    else{
+        prepare_for_floppyDMA_read();
+        floppy_rw_command(activeRequest->drive, head, cyl, sector, FLOPPY_SECTORS_PER_TRACK, FLOPPY_READ_DATA);
+    }
+}
+
+// Copy the data of the current transfer into (toBuffer set) or out of the bounce buffer
+static void floppy_bounce(int toBuffer){
+    uint8 *buffer = bounceBuffer;
+
+    for(block_request_t *member = activeRequest; member; member = member->merged){
+        // Merged requests always move whole, a lone request only moves this transfer's part
+        uint32 bytes = (transferMerged ? member->count : transferCount) * FLOPPY_SECTOR_SIZE;
 
-        floppy_rw_command(drive, head, cyl, sector, EOT, &st0, &st1, &st2, &headOut, &cylOut, &sectOut, FLOPPY_WRITE_DATA);
-
-        int error = 0;
-
-        if(st0 >> 6 == 2){error = 1;}
-        if(st1 & 0x80) {error = 1;}
-        if(st0 & 0x08) {error = 1;}
-        if(st0 >> 6 == 3){error = 1;}
-        if(st1 & 0x20) {error = 1;}
-        if(st1 & 0x10) {error = 1;}
-        if(st1 & 0x04) {error = 1;}
-        if((st1|st2) & 0x01) {error = 1;}
-        if(st2 & 0x40) {error = 1;}
-        if(st2 & 0x20) {error = 1;}
-        if(st2 & 0x10) {error = 1;}
-        if(st2 & 0x04) {error = 1;}
-        if(st2 & 0x02) {error = 1;}
-        if(st1 & 0x02) {error = 2;}
-        if(!error){
-            return 0;
+        for(uint32 i = 0; i < bytes; i++){
+            if(toBuffer)
+                buffer[i] = member->address[i];
+            else
+                member->address[i] = buffer[i];
         }
-        if(error > 1){
-            printf("Error writing floppy!");
-            return -2;
+
+        buffer += bytes;
+    }
+}
+
+// Set up the transfer for the active read/write request, merging in whatever follows it
+static void floppy_prepare_transfer(){
+    block_request_t *request = activeRequest;
+    uint16 left = floppy_cylinder_left(request->lba);
+
+    request->merged = 0;
+    transferLba = request->lba;
+    transferAddress = request->address;
+    transferCount = request->count < left ? request->count : left;
+    transferMerged = 0;
+    transferBounced = 0;
+
+    // Only a request that finishes on this cylinder can take others along
+    if(request->count <= left){
+        block_request_t *last = request;
+        block_request_t *candidate = queueHead;
+
+        while(candidate){
+            block_request_t *following = candidate->next;
+
+            if(candidate->type == request->type && candidate->drive == request->drive &&
+               candidate->lba == transferLba + transferCount && transferCount + candidate->count <= left){
+                floppy_queue_remove(candidate);
+                last->merged = candidate;
+                candidate->merged = 0;
+                last = candidate;
+                transferCount += candidate->count;
+                transferMerged++;
+
+                // Something further back in the queue may now be adjacent too
+                following = queueHead;
+            }
+
+            candidate = following;
         }
+    }
 
-        printf("Error writing floppy!");
+    if(transferMerged){
+        schedStats.merged += transferMerged;
+    }
+    else{
+        // Go straight to the request's memory for as many sectors as DMA can reach in one go
+        uint16 direct = dma_safe_length(transferAddress, transferCount * FLOPPY_SECTOR_SIZE) / FLOPPY_SECTOR_SIZE;
+
+        if(direct > 0)
+            transferCount = direct;
+        else
+            transferBounced = 1;
+    }
+
+    if(transferMerged || transferBounced){
+        transferAddress = bounceBuffer;
 
+        if(request->type == BLOCK_REQUEST_WRITE)
+            floppy_bounce(1);
     }
-    printf("Error writing floppy!");
-    return -1;
 
+    uint16 position = floppy_position(request);
+    uint16 fromCyl = headPosition / FLOPPY_HEADS;
+    uint16 toCyl = position / FLOPPY_HEADS;
+    schedStats.seekDistance += fromCyl > toCyl ? fromCyl - toCyl : toCyl - fromCyl;
+    schedStats.commands++;
+    headPosition = position;
 }
 
-int floppy_read(int drive, uint32 lba, void* address, uint16 count){
-    initFloppyDMA((uint32) address, count);
+// Write the first command of the active request, the IRQ6 handler takes it from here
+static void floppy_issue(block_request_t *request){
+    switch(request->type){
+        case BLOCK_REQUEST_READ:
+        case BLOCK_REQUEST_WRITE:
+            floppy_prepare_transfer();
+            floppy_start_transfer();
+            break;
 
-    drive_select(drive);
+        case BLOCK_REQUEST_RECALIBRATE:
+            floppy_write_cmd(FLOPPY_RECALIBRATE);
+            floppy_write_cmd(request->drive);
+            headPosition = 0;
+            break;
 
-    uint16 cyl;
-    uint16 head;
-    uint16 sector;
-    lba_2_chs(lba, &cyl, &head, &sector);
+        case BLOCK_REQUEST_RESET:
+            outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, 0);
+            floppy_forget_state();
+            outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, floppy_dor());
+            break;
+    }
+}
+
+// Put the controller to work on a request
+// If the drive's motor is not up to speed yet, the timer issues the command later
+static void floppy_start(block_request_t *request){
+    request->state = BLOCK_REQUEST_ACTIVE;
+    activeRequest = request;
+    spinningUp = 0;
+
+    if(request->type != BLOCK_REQUEST_RESET && drive_select(request->drive)){
+        spinningUp = 1;
+        return;
+    }
+
+    floppy_issue(request);
+}
+
+// Start the next pending request if the controller is free
+static void floppy_dispatch(){
+    if(activeRequest || !queueHead || plugged)
+        return;
+
+    block_request_t *request = floppy_pick();
+    floppy_queue_remove(request);
+    floppy_start(request);
+}
+
+// Finish the active request and everything merged into it
+static void floppy_complete(int result){
+    block_request_t *request = activeRequest;
+    activeRequest = 0;
+    driveState.lastUse = floppyTicks;
+
+    while(request){
+        block_request_t *merged = request->merged;
+
+        request->result = result;
+        request->state = result < 0 ? BLOCK_REQUEST_FAILED : BLOCK_REQUEST_DONE;
+        unblock(request->waiter);
+
+        request = merged;
+    }
 
-    int EOT = 19;
+    floppy_dispatch();
+}
+
+// Called once the current transfer went through
+static void floppy_transfer_done(){
+    block_request_t *request = activeRequest;
+
+    if((transferMerged || transferBounced) && request->type == BLOCK_REQUEST_READ)
+        floppy_bounce(0);
+
+    if(transferMerged){
+        floppy_complete(0);
+        return;
+    }
+
+    request->lba += transferCount;
+    request->address += transferCount * FLOPPY_SECTOR_SIZE;
+    request->count -= transferCount;
+    request->retries = 0;
+
+    if(request->count == 0){
+        floppy_complete(0);
+    }
+    else if(scheduler == FLOPPY_SCHED_FIFO){
+        floppy_prepare_transfer();
+        floppy_start_transfer();
+    }
+    else{
+        // Let the elevator decide whether the rest of this request goes next
+        request->state = BLOCK_REQUEST_QUEUED;
+        floppy_queue_append(request);
+        activeRequest = 0;
+        floppy_dispatch();
+    }
+}
 
+void floppy_irq_handler(regs *r){
+    (void) r;
+    block_request_t *request = activeRequest;
     uint8 st0;
     uint8 st1;
     uint8 st2;
+    uint8 cyl;
     int cylOut;
     int headOut;
     int sectOut;
 
+    if(!request)
+        return; // Nothing was waiting on this interrupt
+
+    switch(request->type){
+        case BLOCK_REQUEST_READ:
+        case BLOCK_REQUEST_WRITE:{
+            floppy_rw_result(&st0, &st1, &st2, &headOut, &cylOut, &sectOut);
+            int error = floppy_rw_status(st0, st1, st2);
+            driveState.cylinder[request->drive] = error ? -1 : cylOut;
+
+            if(error == 0)
+                floppy_transfer_done();
+            else if(error == 1 && ++request->retries < 20)
+                floppy_start_transfer();
+            else
+                floppy_complete(error == 2 ? -2 : -1);
+            break;
+        }
 
-    for(int i = 0; i < 20; i++){
+        case BLOCK_REQUEST_RECALIBRATE:
+            floppy_sense_interrupt(&st0, &cyl);
+
+            if(!(st0 & 0x20) && ++request->retries < 20){
+                floppy_write_cmd(FLOPPY_RECALIBRATE);
+                floppy_write_cmd(request->drive);
+            }
+            else{
+                driveState.cylinder[request->drive] = (st0 & 0x20) ? 0 : -1;
+                floppy_complete((st0 & 0x20) ? 0 : -1);
+            }
+            break;
 
-        prepare_for_floppyDMA_read();
+        case BLOCK_REQUEST_RESET:
+            // A reset raises one interrupt on behalf of all four drives
+            for(int i = 0; i < 4; i++)
+                floppy_sense_interrupt(&st0, &cyl);
+            floppy_complete(0);
+            break;
+    }
+}
 
-        floppy_rw_command(drive, head, cyl, sector, EOT, &st0, &st1, &st2, &headOut, &cylOut, &sectOut, FLOPPY_READ_DATA);
-
-        int error = 0;
-
-        if(st0 >> 6 == 2){error = 1;}
-        if(st1 & 0x80) {error = 1;}
-        if(st0 & 0x08) {error = 1;}
-        if(st0 >> 6 == 3){error = 1;}
-        if(st1 & 0x20) {error = 1;}
-        if(st1 & 0x10) {error = 1;}
-        if(st1 & 0x04) {error = 1;}
-        if((st1|st2) & 0x01) {error = 1;}
-        if(st2 & 0x40) {error = 1;}
-        if(st2 & 0x20) {error = 1;}
-        if(st2 & 0x10) {error = 1;}
-        if(st2 & 0x04) {error = 1;}
-        if(st2 & 0x02) {error = 1;}
-        if(st1 & 0x02) {error = 2;}
-        if(!error){
-            return 0;
-        }
-        if(error > 1){
-            printf("Error reading floppy!");
-            return -2;
+// Runs on every IRQ0 tick: finishes motor spin-ups and switches idle motors off
+void floppy_timer_handler(regs *r){
+    (void) r;
+    floppyTicks++;
+
+    if(activeRequest){
+        if(spinningUp && (int)(driveState.motorReady - floppyTicks) <= 0){
+            spinningUp = 0;
+            floppy_issue(activeRequest);
         }
+    }
+    else if(!queueHead && driveState.motors && floppyTicks - driveState.lastUse >= FLOPPY_MOTOR_OFF_TICKS){
+        driveState.motors = 0;
+        outb(FLOPPY_DIGITAL_OUTPUT_REGISTER, floppy_dor());
+    }
+}
+
+// Hook the queue up to IRQ6 and the motor timer to IRQ0, must run before interrupts are enabled
+// The DMA pool and the block device table must be set up first
+void floppy_install(){
+    queueHead = 0;
+    queueTail = 0;
+    activeRequest = 0;
+    spinningUp = 0;
+    floppyTicks = 0;
+    floppy_forget_state();
+    bounceBuffer = (uint8 *) dma_alloc(FLOPPY_HEADS * FLOPPY_SECTORS_PER_TRACK * FLOPPY_SECTOR_SIZE);
+    scheduler = FLOPPY_SCHED_CSCAN;
+    plugged = 0;
+    headPosition = 0;
+
+    schedStats.commands = 0;
+    schedStats.merged = 0;
+    schedStats.seekDistance = 0;
+
+    irq_install_handler(floppy_irq, floppy_irq_handler);
+    irq_install_handler(0, floppy_timer_handler);
+
+    floppyDevice.name = "fd0";
+    floppyDevice.unit = 0;
+    floppyDevice.sectorCount = 80 * FLOPPY_HEADS * FLOPPY_SECTORS_PER_TRACK;
+    floppyDevice.read = floppy_read;
+    floppyDevice.write = floppy_write;
+    floppyDevice.flush = 0;
+    floppyDevice.submit = floppy_submit;
+    floppyDevice.wait = floppy_wait;
+    floppyDevice.plug = floppy_plug;
+    floppyDevice.unplug = floppy_unplug;
+    blockdev_register(&floppyDevice);
+}
+
+void floppy_set_scheduler(floppy_scheduler_t policy){
+    uint32 eflags = floppy_lock_irq();
+    scheduler = policy;
+    floppy_unlock_irq(eflags);
+}
+
+void floppy_plug(){
+    uint32 eflags = floppy_lock_irq();
+    plugged = 1;
+    floppy_unlock_irq(eflags);
+}
+
+void floppy_unplug(){
+    uint32 eflags = floppy_lock_irq();
+    plugged = 0;
+    floppy_dispatch();
+    floppy_unlock_irq(eflags);
+}
+
+void floppy_get_sched_stats(floppy_sched_stats_t *stats){
+    uint32 eflags = floppy_lock_irq();
+    *stats = schedStats;
+    floppy_unlock_irq(eflags);
+}
+
+void floppy_submit(block_request_t *request){
+    request->state = BLOCK_REQUEST_QUEUED;
+    request->result = 0;
+    request->retries = 0;
+    request->merged = 0;
+    request->waiter = getpid();
+
+    uint32 eflags = floppy_lock_irq();
 
+    floppy_queue_append(request);
+    floppy_dispatch();
+
+    floppy_unlock_irq(eflags);
+}
+
+int floppy_wait(block_request_t *request){
+    uint32 eflags = floppy_lock_irq();
+
+    while(request->state == BLOCK_REQUEST_QUEUED || request->state == BLOCK_REQUEST_ACTIVE){
+        // User processes sleep so that schedule() can run someone else,
+        // anything else just halts until the next interrupt
+        if(block() < 0)
+            asm volatile("sti; hlt; cli");
     }
-    printf("Error reading floppy!");
-    return -1;
 
+    floppy_unlock_irq(eflags);
+
+    return request->result;
 }
 
+/*
+ * https://wiki.osdev.org/Floppy_Disk_Controller#Read.2FWrite
+ *
+ * Transfer the LBA range [lba, lba + count) to or from memory, count is in sectors
+ * The range is split on cylinder boundaries so that each piece is one controller command
+ */
+int floppy_transfer(int drive, uint32 lba, uint8 *address, uint16 count, int type){
+    if(count == 0)
+        return 0;
+
+    block_request_t request;
+    request.type = type;
+    request.drive = drive;
+    request.lba = lba;
+    request.address = address;
+    request.count = count;
+
+    floppy_submit(&request);
+    return floppy_wait(&request);
+}
+
+int floppy_write(int drive, uint32 lba, void* address, uint16 count){
+    int result = floppy_transfer(drive, lba, (uint8 *) address, count, BLOCK_REQUEST_WRITE);
+    if(result < 0)
+        printf("Error writing floppy!");
+    return result;
+}
 
-void floppy_rw_command(int drive, int head, int cyl, int sect, int EOT, uint8 *st0, uint8 *st1, uint8 *st2,
-                       int *headResult, int *cylResult, int *sectResult, int command) {
+int floppy_read(int drive, uint32 lba, void* address, uint16 count){
+    int result = floppy_transfer(drive, lba, (uint8 *) address, count, BLOCK_REQUEST_READ);
+    if(result < 0)
+        printf("Error reading floppy!");
+    return result;
+}
+
+
+void floppy_rw_command(int drive, int head, int cyl, int sect, int EOT, int command) {
     int MT = 0x80; // set to 0x80 to enable multi-track, or 0 to disable
     int MFM = 0x40; //set to 0x40 to enable magnetic-encoding-mode, or 0 to disable. According to the wiki this should always be on
 
@@ -481,16 +1004,10 @@ void floppy_rw_command(int drive, int head, int cyl, int sect, int EOT, uint8 *s
     // Eighth parameter byte = 0xff (all floppy drives use 512bytes per sector)
     floppy_write_cmd(0xff);
 
-    uint8 RQM;
-    uint8 MSR;
-    while(1){
-        MSR = inb(FLOPPY_MAIN_STATUS_REGISTER);
-        RQM = (MSR & 0x80) > 1;
-        //printf(toString(MSR, 2));
-        //sleep(10);
-        if(RQM)
-            break;
-    }
+    // The result phase is read by floppy_rw_result() once IRQ6 fires
+}
+
+void floppy_rw_result(uint8 *st0, uint8 *st1, uint8 *st2, int *headResult, int *cylResult, int *sectResult) {
 
     // First result byte = st0 status register
     *st0 = floppy_read_data();
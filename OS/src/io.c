@@ -47,6 +47,21 @@ uint16 inw(uint16 port)
    return ret;
 }
 
+// outl (out long) - write a 32-bit value to an I/O port address (16-bit)
+void outl(uint16 port, uint32 value)
+{
+    asm volatile ("outl %1, %0" : : "dN" (port), "a" (value));
+	return;
+}
+
+// inl (in long) - read a 32-bit value from an I/O port address (16-bit)
+uint32 inl(uint16 port)
+{
+   uint32 ret;
+   asm volatile ("inl %1, %0" : "=a" (ret) : "dN" (port));
+   return ret;
+}
+
 // Setting the cursor does not display anything visually
 // Setting the cursor is simply used by putchar() to find where to print next
 // This can also be set independently of putchar() to print at any x, y coordinate on the screen
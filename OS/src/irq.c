@@ -52,7 +52,7 @@ void irq_remap(void)
     outb(0xA1, 0x0);
 }
 
-static volatile int currentInterrupts[15];
+static volatile int currentInterrupts[16];
 
 void irq_install()
 {
@@ -4,21 +4,82 @@
 #include "./isr.h"
 #include "./fat.h"
 #include "./string.h"
+#include "./cache.h"
+#include "./dma.h"
+#include "./blockdev.h"
+#include "./fdc.h"
+#include "./ata.h"
+#include "./ramdisk.h"
+
+// Set to 1 to copy the file system into a RAM disk at boot and run it from memory,
+// which takes drive latency out of file system benchmarks
+#define RAMDISK_ROOT 0
+
+// Set to 1 to let the cache hold on to writes and flush them from a background process,
+// otherwise every write goes straight through to the drive
+#define CACHE_WRITE_BACK 0
 
 void prockernel();
 void fileproc();
 
+// Block device the file system is mounted from
+int rootDevice;
+
+// End of the kernel's BSS, from the linker
+extern char _end[];
+
+// Where the FATs start, the kernel has to end below it (see init_fs())
+#define KERNEL_LIMIT 0x20000
+
+// Process stacks go in the free memory between the file system log buffer (0x24000 - 0x26400)
+// and the file buffer pool at 0x30000, well away from the kernel, each grows down from its top
+#define PROC_STACK_SIZE 0x4000
+#define PROC_STACK_TOP 0x30000
+
 int main() 
 {
 	// Clear the screen
 	clearscreen();
 
+	if((uint32) _end > KERNEL_LIMIT)
+	{
+		printf("Error: The kernel runs into the FATs!\n");
+		return 0;
+	}
+
 	// Initialize our keyboard
 	initkeymap();
 
 	idt_install();
     isrs_install();
     irq_install();
+	dma_pool_init();
+	blockdev_init();
+	ramdisk_init();
+	floppy_install();
+	ata_install();
+
+	// Run the file system on the first hard disk if there is one, otherwise on the floppy
+	rootDevice = blockdev_find("hd0");
+	if(rootDevice < 0)
+		rootDevice = blockdev_find("fd0");
+
+	// Interrupts drive the floppy request queue and ATA DMA, so turn them on
+	asm volatile("sti");
+
+	// Set up the sector cache used by the file system
+	cache_init(CACHE_DEFAULT_BUDGET);
+
+	if(RAMDISK_ROOT)
+	{
+		uint32 sectors = blockdev_get(rootDevice)->sectorCount;
+		if(sectors > RAMDISK_MAX_SECTORS)
+			sectors = RAMDISK_MAX_SECTORS;
+
+		int ramDevice = ramdisk_create((void *) RAMDISK_ADDRESS, sectors);
+		if(ramDevice >= 0 && ramdisk_load(ramDevice, rootDevice) == 0)
+			rootDevice = ramDevice;
+	}
 
 	startkernel(prockernel);
 	
@@ -29,7 +90,13 @@ void prockernel()
 {
 	// Create the user processes
 
-	createproc(fileproc, (void *) 0x10000);
+	createproc(fileproc, (void *) (PROC_STACK_TOP - PROC_STACK_SIZE));
+
+	if(CACHE_WRITE_BACK)
+	{
+		cache_set_write_back(1);
+		createproc(cache_flusher, (void *) PROC_STACK_TOP);
+	}
 
 	// Schedule the next process
 
@@ -52,7 +119,7 @@ void fileproc()
 {
 	// Initialize our file system
 	directory_t root;
-	init_fs(&root);
+	init_fs(rootDevice, &root);
 	char input = ' ';
 
 	while(input != 'q')
@@ -60,11 +127,11 @@ void fileproc()
 		char filename[8];
 		char ext[3];
 
-		// A pointer to the directory entry we will hopefully find
-		directory_entry_t *foundEntry = 0;
+		// The directory entry we will hopefully find
+		directory_entry_t foundEntry;
 
 		// Ask the user to make a selection
-		printf("Make a selection (c, d, r, w, q): ");
+		printf("Make a selection (c, d, r, w, z, m, p, f, k, q): ");
 		char input = getchar();
 		putchar(input);
 		putchar('\n');
@@ -74,8 +141,93 @@ void fileproc()
 		{
 			break;
 		}
+		// Make a directory, or print a file, given a path like /a/b/c.txt
+		else if(input == 'm' || input == 'p')
+		{
+			char path[101];
+			printf("Enter path: ");
+			scanf(path);
+			putchar('\n');
+
+			if(input == 'm')
+			{
+				if(makeDirectory(path) < 0)
+					printf("Error: Could not make the directory!\n");
+				continue;
+			}
+
+			int fd = openPath(path, 0);
+			if(fd < 0)
+			{
+				printf("Error: Tried reading a file that doesn't exist!\n");
+				continue;
+			}
+
+			uint8 buffer[512];
+			int count;
+			while((count = read(fd, buffer, sizeof(buffer))) > 0)
+			{
+				for(int i = 0; i < count; i++)
+					putchar((char)buffer[i]);
+			}
+
+			putchar('\n');
+			close(fd);
+			continue;
+		}
+		// Defragment the whole directory tree and show how fragmented it was before and after
+		else if(input == 'f')
+		{
+			printf("Defragmenting...\n");
+
+			defrag_report_t report;
+			uint16 before = 0;
+			int first = 1;
+			int done = 0;
+			while(!done)
+			{
+				done = defragment(16, &report);
+
+				if(first)
+					before = report.before.score;
+				first = 0;
+			}
+
+			printf("Fragmentation score: ");
+			printint(before);
+			printf(" -> ");
+			printint(report.after.score);
+			putchar('\n');
+			continue;
+		}
+		// Check the file system, and repair it if the user wants to
+		else if(input == 'k')
+		{
+			printf("Checking File System...\n");
+
+			fsck_report_t report;
+			int problems = checkFilesystem(0, &report);
+
+			printint(problems);
+			printf(" problems found\n");
+
+			if(problems > 0)
+			{
+				printf("Repair (y, n): ");
+				char answer = getchar();
+				putchar(answer);
+				putchar('\n');
+
+				if(answer == 'y' && checkFilesystem(1, &report) >= 0)
+				{
+					printint(report.repaired);
+					printf(" problems repaired\n");
+				}
+			}
+			continue;
+		}
 		// If the input was invalid, just restart loop
-		else if(input != 'c' && input != 'd' && input != 'r' && input != 'w')
+		else if(input != 'c' && input != 'd' && input != 'r' && input != 'w' && input != 'z')
 		{
 			printf("Error: Invalid input!\n");
 			continue;
@@ -91,20 +243,11 @@ void fileproc()
 		putchar('\n');
 
 		// Search the directory to see if there exists an entry that contains the file name and extension
-		int fileExists = findFile(filename, ext, root, foundEntry);
+		int fileExists = findFile(filename, ext, root, &foundEntry);
 
 		// If we actually found a file...
 		if(fileExists)
 		{
-			// Create a structure for our file (contains our file's data and meta data)
-			file_t file;
-
-			// Point our structure's entry to the entry that we found inside our file system
-			file.entry = *foundEntry;
-
-			// Open the file (to retrieve the bytes inside the file from the disk)
-			openFile(&file);
-
 			// We cannot create a new file with the same name! (Do nothing)
 			if(input == 'c')
 			{
@@ -115,9 +258,9 @@ void fileproc()
 			{
 				printf("Deleting File...\n");
 
-				// Close the file before deleting it
-				putchar('\n');
-				closeFile(&file);
+				// Create a structure for our file, deleting only needs its directory entry
+				file_t file;
+				file.entry = foundEntry;
 
 				deleteFile(&file, &root);
 			}
@@ -127,19 +270,26 @@ void fileproc()
 				clearscreen();
 				printf("Reading File...\n");
 
-				// Print the contents of the file to the string
-				for(uint32 i = 0; i < file.entry.fileSize; i++)
+				// Open the file, it is read a sector at a time instead of being loaded all at once
+				int fd = open(&root, filename, ext, 0);
+				if(fd < 0)
 				{
-					// Read one byte from the file
-					uint8 byte = readByte(&file, i);
+					printf("Error: Could not open the file!\n");
+					continue;
+				}
 
-					// Print it to the screen
-					putchar((char)byte);
+				// Print the contents of the file to the screen
+				uint8 buffer[512];
+				int count;
+				while((count = read(fd, buffer, sizeof(buffer))) > 0)
+				{
+					for(int i = 0; i < count; i++)
+						putchar((char)buffer[i]);
 				}
 
 				// Close the file
 				putchar('\n');
-				closeFile(&file);
+				close(fd);
 			}
 			// Allow the user to type in characters and write those to the file
 			else if(input == 'w')
@@ -147,6 +297,13 @@ void fileproc()
 				clearscreen();
 				printf("Writing File...\n");
 
+				int fd = open(&root, filename, ext, 0);
+				if(fd < 0)
+				{
+					printf("Error: Could not open the file!\n");
+					continue;
+				}
+
 				// This will keep track of how many bytes are written to the file
 				// For now, we will only allow 512 bytes (1 sector) to be written to the file
 				uint32 i = 0;
@@ -160,7 +317,7 @@ void fileproc()
 					if(byte != 'n')
 					{
 						putchar((char)byte);
-						writeByte(&file, byte, i);
+						write(fd, &byte, 1);
 						i++;
 					}
 
@@ -168,15 +325,35 @@ void fileproc()
 				
 				// If we have not overwritten the entire sector, do so now
 				// This prevents nasty leftovers in the sector from old writes
+				uint8 zero = 0;
 				while(i % 512 != 0)
 				{
-					writeByte(&file, 0, i);
+					write(fd, &zero, 1);
 					i++;
 				}
 
 				// Close the file (save the results to the disk)
 				putchar('\n');
-				closeFile(&file);
+				close(fd);
+			}
+			// Compress the file, or uncompress it if it already is
+			else if(input == 'z')
+			{
+				file_t file;
+				file.entry = foundEntry;
+
+				int compress = !(foundEntry.attributes & FILE_ATTRIBUTE_COMPRESSED);
+				if(openFile(&file) < 0 || setCompression(&file, compress) < 0)
+				{
+					printf("Error: Could not load the file!\n");
+					continue;
+				}
+
+				// Closing stores it in the new form
+				if(closeFile(&file) < 0)
+					printf("Error: Could not store the file!\n");
+				else
+					printf(compress ? "File compressed\n" : "File uncompressed\n");
 			}
 		}
 		// If we didn't find the file...
@@ -210,9 +387,16 @@ void fileproc()
 			{
 				printf("Error: Tried writing to a file that doesn't exist!\n");
 			}
+			else if(input == 'z')
+			{
+				printf("Error: Tried compressing a file that doesn't exist!\n");
+			}
 		}	
 	}
 
+	// Flush anything still buffered before leaving
+	unmount_fs();
+
 	exit();
 }
 
@@ -15,7 +15,8 @@ proc_t *kernel;     // The kernel process
 
 // Select the next user process (proc_t *next) to run
 // Selection must be made from the processes array (proc_t processes[])
-// Count is the number of user processes are ready and available
+// Count is the number of user processes that are ready or waiting (still alive)
+// If every one of them is waiting, the kernel is selected as next
 int schedule()
 {
     int count = 0;
@@ -23,7 +24,7 @@ int schedule()
     // Check how many processes there are left (return accurate count)
     for (int i=0; i < MAX_PROCS; i++)
     {
-        if(processes[i].type == PROC_USER && processes[i].status == PROC_READY)
+        if(processes[i].type == PROC_USER && (processes[i].status == PROC_READY || processes[i].status == PROC_WAITING))
         {
             count++;
         }
@@ -56,6 +57,9 @@ int schedule()
                 return count;
             }
         }
+
+        // Everyone is waiting on I/O
+        next = kernel;
     }
     return count;
 }
@@ -144,6 +148,39 @@ void exit()
     return;
 }
 
+// Returns the pid of the process that is running
+int getpid()
+{
+    return running->pid;
+}
+
+// Put the running user process to sleep until unblock() is called with its pid
+// The caller should disable interrupts before checking whatever it waits on
+// so that the wake up cannot slip in before the process is marked as waiting
+// Returns -1 without sleeping if the kernel is running
+int block()
+{
+    if (running->type != PROC_USER)
+    {
+        return -1;
+    }
+
+    running->status = PROC_WAITING;
+    next = kernel;
+    switchcontext();
+
+    return 0;
+}
+
+// Wake up a process put to sleep with block(), called from interrupt handlers
+void unblock(int pid)
+{
+    if (pid >= 0 && pid < process_index && processes[pid].status == PROC_WAITING)
+    {
+        processes[pid].status = PROC_READY;
+    }
+}
+
 // Yield the current process
 // This will give another process a chance to run
 // If we yielded a user process, context switch to the kernel process
@@ -163,6 +200,11 @@ void yield()
         printf("Error: No next process assigned!\n");
         while (1);                      // Infinite loop to prevent crashing
     }
+    else if (next == kernel)            // Every user process is waiting
+    {
+        asm volatile("sti; hlt");       // Idle until an interrupt (possibly) wakes one up
+        return;
+    }
 
     switchcontext();
 
@@ -0,0 +1,55 @@
+#include "./types.h"
+#include "./io.h"
+#include "./pci.h"
+
+// PCI configuration space through the 0xCF8/0xCFC ports
+// Only bus 0 is searched, which is where Bochs and QEMU put all of their devices
+
+static uint32 pci_address(pci_device_t device, uint8 offset)
+{
+    return 0x80000000 | (device.bus << 16) | (device.slot << 11) | (device.function << 8) | (offset & 0xFC);
+}
+
+uint32 pci_read(pci_device_t device, uint8 offset)
+{
+    outl(PCI_CONFIG_ADDRESS, pci_address(device, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_write(pci_device_t device, uint8 offset, uint32 value)
+{
+    outl(PCI_CONFIG_ADDRESS, pci_address(device, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+int pci_find_class(uint8 classCode, uint8 subclass, pci_device_t *device)
+{
+    pci_device_t candidate;
+    candidate.bus = 0;
+
+    for(int slot = 0; slot < 32; slot++)
+    {
+        for(int function = 0; function < 8; function++)
+        {
+            candidate.slot = slot;
+            candidate.function = function;
+
+            if((pci_read(candidate, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF)
+            {
+                // Without function 0 there is nothing else in this slot either
+                if(function == 0)
+                    break;
+                continue;
+            }
+
+            uint32 class = pci_read(candidate, PCI_CLASS);
+            if((class >> 24) == classCode && ((class >> 16) & 0xFF) == subclass)
+            {
+                *device = candidate;
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,94 @@
+#include "./types.h"
+#include "./fat.h"
+#include "./string.h"
+#include "./io.h"
+#include "./ramdisk.h"
+
+// RAM disk block devices
+// A RAM disk is a block of memory that looks like any other drive to the cache and the file system,
+// which makes it a scratch volume and a way to time fat.c without any drive latency mixed in
+
+// Sectors copied by one read from the source device in ramdisk_load()
+#define RAMDISK_LOAD_CHUNK 72
+
+typedef struct
+{
+    uint8 *base;
+    blockdev_t device;
+} ramdisk_t;
+
+// The statics below live in .bss, which nothing clears for us, so ramdisk_init() must run before use
+static ramdisk_t disks[RAMDISK_MAX_DISKS];
+static int diskCount;
+static char *diskNames[RAMDISK_MAX_DISKS] = { "rd0", "rd1" };
+
+void ramdisk_init()
+{
+    diskCount = 0;
+
+    // Memory above 1MB is only usable with the A20 line on, the "fast A20" bit of port 0x92 turns it on
+    // Bit 0 of the same port resets the machine, so it must be written back as 0
+    outb(0x92, (inb(0x92) | 0x02) & 0xFE);
+}
+
+int ramdisk_read(int disk, uint32 lba, void *address, uint16 count)
+{
+    memcpy(address, disks[disk].base + lba * BLOCK_SIZE, count * BLOCK_SIZE);
+    return 0;
+}
+
+int ramdisk_write(int disk, uint32 lba, void *address, uint16 count)
+{
+    memcpy(disks[disk].base + lba * BLOCK_SIZE, address, count * BLOCK_SIZE);
+    return 0;
+}
+
+int ramdisk_create(void *base, uint32 sectorCount)
+{
+    if(diskCount == RAMDISK_MAX_DISKS)
+        return -1;
+
+    ramdisk_t *disk = &disks[diskCount];
+    disk->base = (uint8 *) base;
+
+    disk->device.name = diskNames[diskCount];
+    disk->device.unit = diskCount;
+    disk->device.sectorCount = sectorCount;
+    disk->device.read = ramdisk_read;
+    disk->device.write = ramdisk_write;
+    disk->device.flush = 0;
+    disk->device.submit = 0;
+    disk->device.wait = 0;
+    disk->device.plug = 0;
+    disk->device.unplug = 0;
+
+    int device = blockdev_register(&disk->device);
+    if(device >= 0)
+        diskCount++;
+
+    return device;
+}
+
+int ramdisk_load(int device, int source)
+{
+    blockdev_t *disk = blockdev_get(device);
+    blockdev_t *from = blockdev_get(source);
+
+    if(!disk || !from)
+        return -1;
+
+    uint32 count = disk->sectorCount < from->sectorCount ? disk->sectorCount : from->sectorCount;
+    uint8 *base = disks[disk->unit].base;
+
+    // Straight from the source device into the RAM disk's memory, skipping the cache
+    for(uint32 lba = 0; lba < count; lba += RAMDISK_LOAD_CHUNK)
+    {
+        uint16 chunk = count - lba < RAMDISK_LOAD_CHUNK ? count - lba : RAMDISK_LOAD_CHUNK;
+
+        int result = blockdev_read(source, lba, base + lba * BLOCK_SIZE, chunk);
+        if(result < 0)
+            return result;
+    }
+
+    return 0;
+}
@@ -60,4 +60,27 @@ void stringcopy(char *src, char *dest, int length)
     {
         dest[i] = src[i];
     }
+}
+// Copy count bytes from src to dest, a word at a time while possible
+void* memcpy(void* dest, void* src, uint32 count)
+{
+    uint32 *dest32 = (uint32 *)dest;
+    uint32 *src32 = (uint32 *)src;
+
+    while(count >= 4)
+    {
+        *dest32++ = *src32++;
+        count -= 4;
+    }
+
+    uint8 *dest8 = (uint8 *)dest32;
+    uint8 *src8 = (uint8 *)src32;
+
+    while(count > 0)
+    {
+        *dest8++ = *src8++;
+        count--;
+    }
+
+    return dest;
 }
\ No newline at end of file